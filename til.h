@@ -6,6 +6,11 @@
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef enum
 {
@@ -23,12 +28,68 @@ typedef enum
     TIL_FALSE = 0,
 } til_bool_t;
 
+typedef enum
+{
+    TIL_ARRAY_VALUES  = 0,
+    TIL_ARRAY_NUMBERS = 1,
+} til_array_kind_t;
+
+typedef enum
+{
+    TIL_FLAG_MODIFIED  = 1 << 0,    /* set by a mutation, til_write_patch re-serializes it */
+    TIL_FLAG_RESIZABLE = 1 << 1,    /* storage has spare capacity (internal) */
+    TIL_FLAG_SHARED    = 1 << 2,    /* storage is shared by identical values, read-only */
+} til_flag_t;
+
+typedef enum
+{
+    TIL_PARSE_DEFAULT  = 0,
+    TIL_PARSE_HASHCONS  = 1 << 0,   /* identical tables, arrays and strings share their storage */
+    TIL_PARSE_ITERATIVE = 1 << 1,   /* explicit container stack instead of recursion, the default */
+    TIL_PARSE_RECURSIVE = 1 << 2,   /* native recursion, its stack use grows with nesting */
+} til_parse_flag_t;
+
+typedef enum
+{
+    TIL_MERGE_DEFAULT       = 0,        /* tables are merged, other values are replaced */
+    TIL_MERGE_APPEND_ARRAYS = 1 << 0,   /* arrays of the patch are appended to the base ones */
+    TIL_MERGE_NIL_DELETES   = 1 << 1,   /* a nil in the patch removes the key */
+} til_merge_flag_t;
+
+typedef struct til_options_t
+{
+    int flags;      /* til_parse_flag_t */
+    int max_depth;  /* of nested tables and arrays, 0 for TIL_MAX_DEPTH */
+} til_options_t;
+
+typedef struct til_stats_t
+{
+    size_t allocated;       /* bytes used by the document */
+    size_t shared;          /* bytes saved by TIL_PARSE_HASHCONS */
+    int    shared_count;    /* storages that were reused */
+} til_stats_t;
+
+/* Source bytes of a parsed value: start includes the whitespace and comments
+ * before the token, end is right after it. -1 when the value was not parsed.
+ */
+typedef struct til_span_t
+{
+    int start;
+    int end;
+} til_span_t;
+
 typedef struct til_cell_t til_cell_t;
 
 typedef struct til_array_t
 {
     int                 length;
-    struct til_value_t* values;
+    int                 kind;   /* til_array_kind_t */
+
+    union
+    {
+        struct til_value_t* values;     /* TIL_ARRAY_VALUES  */
+        double*             numbers;    /* TIL_ARRAY_NUMBERS */
+    };
 } til_array_t;
 
 typedef struct til_table_t
@@ -40,6 +101,7 @@ typedef struct til_table_t
 typedef struct til_value_t
 {
     til_type_t type;
+    int        flags;   /* til_flag_t */
 
     union
     {
@@ -55,6 +117,8 @@ typedef struct til_value_t
             char* buffer;
         } string;
     };
+
+    til_span_t span;
 } til_value_t;
 
 struct til_cell_t
@@ -65,12 +129,146 @@ struct til_cell_t
 
 typedef struct til_state_t til_state_t;
 
+/* Node of a binary image: offsets are relative to the start of the image so
+ * it can be mapped anywhere and read in place.
+ */
+typedef struct til_node_t
+{
+    unsigned short type;        /* til_type_t */
+    unsigned short kind;        /* til_array_kind_t */
+    unsigned int   length;      /* elements, or bytes of a string */
+
+    union
+    {
+        double             number;
+        int                boolean;
+        unsigned long long offset;  /* of the string bytes, array elements or table name/value pairs */
+    };
+} til_node_t;
+
+typedef struct til_image_t til_image_t;
+
 TIL_API til_value_t* til_parse(const char* code, til_state_t** state);
+TIL_API til_value_t* til_parse_ex(const char* code, const til_options_t* options, til_state_t** state);
 TIL_API void         til_release(til_state_t* state);
+TIL_API til_state_t* til_retain(til_state_t* state);
 
+TIL_API void         til_stats(const til_state_t* state, til_stats_t* stats);
+
+/* Arrays whose elements are all numbers are stored packed (TIL_ARRAY_NUMBERS),
+ * use these accessors instead of reading array.values directly.
+ */
+TIL_API const double* til_array_numbers(const til_value_t* value);
+TIL_API til_value_t   til_array_get(const til_value_t* value, int index);
+
+/* til_print writes JSON, til_write writes TIL code that til_parse reads back
+ * (inf and nan have no TIL form). Numbers are written with exact digits.
+ */
 TIL_API void         til_print(const til_value_t* value, FILE* out);
 TIL_API void         til_write(const til_value_t* value, FILE* out);
 
+/* Streaming transcoders: the input is read in chunks and the output buffered,
+ * no tree is built and memory only grows with nesting. JSON strings with '"'
+ * cannot be written in TIL and fail, so do documents nested deeper than
+ * TIL_MAX_DEPTH, and JSON numbers with an exponent longer than 511 chars.
+ * The output written before a failure is left as is.
+ */
+TIL_API til_bool_t   til_to_json(FILE* in, FILE* out);
+TIL_API til_bool_t   til_from_json(FILE* in, FILE* out);
+
+/* Mutations copy the given value into the state, it is freed by til_release().
+ * Pointers into a table or array are invalidated by inserting into it. Setting
+ * a number into a packed array returns the array itself. Values flagged
+ * TIL_FLAG_SHARED cannot be mutated.
+ */
+TIL_API til_value_t* til_table_get(const til_value_t* table, const char* name);
+TIL_API til_value_t* til_table_set(til_state_t* state, til_value_t* table, const char* name, const til_value_t* value);
+TIL_API til_bool_t   til_table_remove(til_state_t* state, til_value_t* table, const char* name);
+
+TIL_API til_value_t* til_array_set(til_state_t* state, til_value_t* array, int index, const til_value_t* value);
+TIL_API til_value_t* til_array_insert(til_state_t* state, til_value_t* array, int index, const til_value_t* value);
+TIL_API til_bool_t   til_array_remove(til_state_t* state, til_value_t* array, int index);
+
+/* Merges the document of patch over the one of base. Only the tables on the
+ * paths of the patch are copied, everything else is shared with the inputs:
+ * the result state retains them until it is released. Mutations refuse the
+ * shared containers (flagged TIL_FLAG_SHARED) and everything inside them,
+ * and base and patch themselves are read-only until the result is released.
+ * The result can be overlaid again. A table on a patch path is copied whole
+ * and its cells are searched linearly for each key of the patch, so the cost
+ * grows with the width of these tables, not only with the size of the patch.
+ */
+TIL_API til_value_t* til_overlay(til_state_t* base, til_state_t* patch, int flags, til_state_t** state);
+
+/* Writes the document parsed into state back as TIL code. Unchanged parts
+ * (comments and formatting included) are copied from the original code,
+ * which must still be alive; only modified values are re-serialized.
+ */
+TIL_API void         til_write_patch(const til_state_t* state, const til_value_t* value, FILE* out);
+
+/* Binary images are mapped read-only and accessed without deserialization,
+ * processes loading the same file share its pages.
+ */
+TIL_API til_bool_t   til_save_binary(const til_value_t* value, const char* path);
+TIL_API til_image_t* til_load_binary(const char* path);
+TIL_API void         til_unload_binary(til_image_t* image);
+
+TIL_API const til_node_t* til_image_root(const til_image_t* image);
+TIL_API const til_node_t* til_node_get(const til_image_t* image, const til_node_t* table, const char* name);
+TIL_API const til_node_t* til_node_name(const til_image_t* image, const til_node_t* table, int index);
+TIL_API const til_node_t* til_node_value(const til_image_t* image, const til_node_t* table, int index);
+TIL_API const til_node_t* til_node_at(const til_image_t* image, const til_node_t* array, int index);
+TIL_API const double*     til_node_numbers(const til_image_t* image, const til_node_t* array);
+TIL_API const char*       til_node_string(const til_image_t* image, const til_node_t* node);
+
+/* Record streams iterate a sequence of top-level tables (one per record, as
+ * in an event log). Records are parsed in batches into an arena owned by the
+ * stream, which is reused once the batch is consumed. With threads > 1 the
+ * batches are parsed in parallel and still returned in order (link with
+ * pthreads, or define TIL_NO_THREADS to always parse on the calling thread).
+ */
+typedef struct til_stream_t til_stream_t;
+
+typedef struct til_stream_options_t
+{
+    til_options_t parse;
+    int           batch_size;   /* bytes of records per batch, 0 for TIL_STREAM_BATCH_SIZE */
+    int           threads;      /* parsing threads, 0 or 1 to parse in til_stream_next */
+} til_stream_options_t;
+
+/* Valid until the next call to til_stream_next or til_stream_close */
+typedef struct til_batch_t
+{
+    int          count;
+    til_value_t* records;   /* read-only with TIL_PARSE_HASHCONS */
+    long long    offset;    /* of the batch in the stream, spans are relative to it */
+    til_state_t* state;     /* owned by the stream */
+} til_batch_t;
+
+TIL_API til_stream_t* til_stream_open(const char* path, const til_stream_options_t* options);
+TIL_API til_stream_t* til_stream_buffer(const char* code, size_t length, const til_stream_options_t* options);
+TIL_API til_bool_t    til_stream_next(til_stream_t* stream, til_batch_t* batch);
+TIL_API long long     til_stream_error(const til_stream_t* stream);
+TIL_API void          til_stream_close(til_stream_t* stream);
+
+/* Snapshots publish documents to concurrent readers. Acquiring and releasing
+ * are wait-free (one atomic add each), a reader keeps its document until it
+ * releases the ticket even if a newer one is published. A replaced state is
+ * released by the last reader leaving it, or by the publisher when it has
+ * none. Creating and publishing take over the reference to the state.
+ */
+typedef struct til_snapshot_t til_snapshot_t;
+
+TIL_API til_snapshot_t*    til_snapshot_create(til_state_t* state, int max_versions);
+TIL_API void               til_snapshot_destroy(til_snapshot_t* snapshot);
+TIL_API til_bool_t         til_snapshot_publish(til_snapshot_t* snapshot, til_state_t* state);
+TIL_API const til_value_t* til_snapshot_acquire(til_snapshot_t* snapshot, int* ticket);
+TIL_API void               til_snapshot_release(til_snapshot_t* snapshot, int ticket);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __TIL_H__ */
 
 #ifdef TIL_IMPL
@@ -81,13 +279,81 @@ TIL_API void         til_write(const til_value_t* value, FILE* out);
 #include <string.h>
 #include <assert.h>
 
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if !defined(_WIN32) && !defined(TIL_NO_THREADS)
+#include <pthread.h>
+#endif
+
+/* 64-bit atomics, add and exchange return the previous value */
+#if defined(_MSC_VER)
+static long long til_atomic_add(long long* ptr, long long value)
+{
+    return InterlockedExchangeAdd64((volatile LONGLONG*)ptr, value);
+}
+
+static long long til_atomic_exchange(long long* ptr, long long value)
+{
+    return InterlockedExchange64((volatile LONGLONG*)ptr, value);
+}
+
+static til_bool_t til_atomic_cas(long long* ptr, long long expected, long long value)
+{
+    return InterlockedCompareExchange64((volatile LONGLONG*)ptr, value, expected) == expected ? TIL_TRUE : TIL_FALSE;
+}
+#else
+static long long til_atomic_add(long long* ptr, long long value)
+{
+    return __atomic_fetch_add(ptr, value, __ATOMIC_ACQ_REL);
+}
+
+static long long til_atomic_exchange(long long* ptr, long long value)
+{
+    return __atomic_exchange_n(ptr, value, __ATOMIC_ACQ_REL);
+}
+
+static til_bool_t til_atomic_cas(long long* ptr, long long expected, long long value)
+{
+    return __atomic_compare_exchange_n(ptr, &expected, value, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? TIL_TRUE : TIL_FALSE;
+}
+#endif
+
 typedef struct til_buffer_t 
 {
-    int count;
-    int capacity;
-    int elemsize;
+    int   count;
+    int   capacity;
+    char* data;
 } til_buffer_t;
 
+/* Nodes and strings of a document are carved from blocks owned by the state,
+ * til_release() frees them all at once.
+ */
+typedef struct til_block_t
+{
+    struct til_block_t* next;
+    int                 used;
+    int                 capacity;
+} til_block_t;
+
+#ifndef TIL_BLOCK_SIZE
+#define TIL_BLOCK_SIZE (64 * 1024)
+#endif
+
+#ifndef TIL_MAX_DEPTH
+#define TIL_MAX_DEPTH 1000
+#endif
+
+#define TIL_BLOCK_HEADER ((int)((sizeof(til_block_t) + 7) & ~7))
+
+typedef struct til_intern_t til_intern_t;
+
 /* @structdef: til_state_t */
 struct til_state_t
 {
@@ -100,8 +366,31 @@ struct til_state_t
     int         length;
     const char* buffer;
 
-    til_buffer_t value_buffers;
-    til_buffer_t string_buffers;
+    til_block_t* blocks;
+    til_block_t* spare;     /* emptied blocks kept by reset_state */
+    til_buffer_t scratch;   /* elements of the containers being parsed */
+    til_buffer_t frames;    /* containers being parsed by parse_iterative */
+
+    int depth;
+    int max_depth;
+
+    int          edits;         /* number of mutations since parsing */
+    til_buffer_t edited;        /* span starts of the mutated containers, as ints */
+    til_bool_t   edited_lost;   /* edited could not grow, til_write_patch walks everything */
+
+    long long    refs;      /* til_retain() and til_release(), atomic */
+    til_value_t* root;
+    til_state_t* layers[2]; /* states a til_overlay() result shares storage with */
+    long long    layered;   /* til_overlay() results sharing this state, atomic */
+
+    /* TIL_PARSE_HASHCONS, the table only lives while parsing */
+    int           hashcons;
+    int           intern_count;
+    int           intern_capacity;
+    til_intern_t* interned;
+
+    int           shared_count;
+    size_t        shared_bytes;
 };
 
 static til_state_t* make_state(const char* code)
@@ -117,6 +406,39 @@ static til_state_t* make_state(const char* code)
         
         state->length = strlen(code);
         state->buffer = code;
+
+        state->blocks = NULL;
+        state->spare  = NULL;
+        state->edits  = 0;
+
+        state->edited.count    = 0;
+        state->edited.capacity = 0;
+        state->edited.data     = NULL;
+        state->edited_lost     = TIL_FALSE;
+
+        state->refs      = 1;
+        state->root      = NULL;
+        state->layers[0] = NULL;
+        state->layers[1] = NULL;
+        state->layered   = 0;
+
+        state->hashcons        = 0;
+        state->intern_count    = 0;
+        state->intern_capacity = 0;
+        state->interned        = NULL;
+        state->shared_count    = 0;
+        state->shared_bytes    = 0;
+
+        state->scratch.count    = 0;
+        state->scratch.capacity = 0;
+        state->scratch.data     = NULL;
+
+        state->frames.count     = 0;
+        state->frames.capacity  = 0;
+        state->frames.data      = NULL;
+
+        state->depth     = 0;
+        state->max_depth = TIL_MAX_DEPTH;
     }
     return state;
 }
@@ -125,11 +447,154 @@ static void free_state(til_state_t* state)
 {
     if (state)
     {
-        free_state(state->next);
+        /* til_release(NULL) would release the states of til_parse(code, NULL) */
+        int i;
+        for (i = 0; i < 2; i++)
+        {
+            if (state->layers[i])
+            {
+                til_atomic_add(&state->layers[i]->layered, -1);
+                til_release(state->layers[i]);
+            }
+        }
+
+        til_block_t* block = state->blocks;
+        while (block)
+        {
+            til_block_t* next = block->next;
+            free(block);
+            block = next;
+        }
+
+        block = state->spare;
+        while (block)
+        {
+            til_block_t* next = block->next;
+            free(block);
+            block = next;
+        }
+
+        free(state->scratch.data);
+        free(state->frames.data);
+        free(state->edited.data);
+        free(state->interned);
         free(state);
     }
 }
 
+static void* arena_alloc(til_state_t* state, int size)
+{
+    size = (size + 7) & ~7;
+
+    til_block_t* block = state->blocks;
+    if (!block || block->used + size > block->capacity)
+    {
+        int capacity = size > TIL_BLOCK_SIZE ? size : TIL_BLOCK_SIZE;
+        til_block_t* new_block;
+        if (capacity == TIL_BLOCK_SIZE && state->spare)
+        {
+            new_block    = state->spare;
+            state->spare = new_block->next;
+        }
+        else
+        {
+            new_block = (til_block_t*)malloc(TIL_BLOCK_HEADER + capacity);
+            if (!new_block)
+            {
+                return NULL;
+            }
+        }
+
+        new_block->used     = 0;
+        new_block->capacity = capacity;
+
+        /* Oversized requests get their own block, keep filling the current one */
+        if (block && capacity > TIL_BLOCK_SIZE)
+        {
+            new_block->next = block->next;
+            block->next     = new_block;
+        }
+        else
+        {
+            new_block->next = block;
+            state->blocks   = new_block;
+        }
+        block = new_block;
+    }
+
+    void* result = (char*)block + TIL_BLOCK_HEADER + block->used;
+    block->used += size;
+    return result;
+}
+
+/* Empties the state to parse another buffer, keeping its memory */
+static void reset_state(til_state_t* state, const char* buffer, int length)
+{
+    til_block_t* block = state->blocks;
+    while (block)
+    {
+        til_block_t* next = block->next;
+        if (block->capacity == TIL_BLOCK_SIZE)
+        {
+            block->next  = state->spare;
+            state->spare = block;
+        }
+        else
+        {
+            free(block);
+        }
+        block = next;
+    }
+    state->blocks = NULL;
+
+    state->line   = 1;
+    state->column = 1;
+    state->cursor = 0;
+    state->length = length;
+    state->buffer = buffer;
+    state->edits  = 0;
+    state->depth  = 0;
+
+    state->edited.count = 0;
+    state->edited_lost  = TIL_FALSE;
+
+    state->scratch.count = 0;
+    state->frames.count  = 0;
+    state->shared_count  = 0;
+    state->shared_bytes  = 0;
+}
+
+static void* buffer_push(til_buffer_t* buffer, const void* data, int size)
+{
+    if (buffer->count + size > buffer->capacity)
+    {
+        int   capacity = buffer->capacity > 0 ? buffer->capacity * 2 : 4096;
+        while (capacity < buffer->count + size)
+        {
+            capacity *= 2;
+        }
+
+        char* new_data = (char*)realloc(buffer->data, capacity);
+        if (!new_data)
+        {
+            return NULL;
+        }
+
+        buffer->data     = new_data;
+        buffer->capacity = capacity;
+    }
+
+    void* result = buffer->data + buffer->count;
+    memcpy(result, data, size);
+    buffer->count += size;
+    return result;
+}
+
+static void* scratch_push(til_state_t* state, const void* data, int size)
+{
+    return buffer_push(&state->scratch, data, size);
+}
+
 static int is_eof(til_state_t* state)
 {
     return state->cursor >= state->length;
@@ -143,7 +608,7 @@ static int peek_char(til_state_t* state)
     }
     else
     {
-        return state->buffer[state->cursor];
+        return (unsigned char)state->buffer[state->cursor];
     }
 }
 
@@ -155,7 +620,8 @@ static int next_char(til_state_t* state)
     }
     else
     {
-        int c = state->buffer[++state->cursor];
+        /* The buffer may not be terminated, as a batch of a record stream */
+        int c = ++state->cursor < state->length ? (unsigned char)state->buffer[state->cursor] : -1;
         if (c == '\n')
         {
             state->line   += 1;
@@ -190,103 +656,418 @@ static int next_line(til_state_t* state)
     return  next_char(state);
 }
 
-static til_value_t* make_value(til_state_t* state, til_type_t type)
+/*
+ * Hash-consing (TIL_PARSE_HASHCONS): finished strings, arrays and tables are
+ * looked up by content and identical ones share a single storage. Children
+ * are interned before their parent, so comparing a container only needs to
+ * compare the storage pointers of its direct children.
+ */
+
+typedef enum
 {
-    til_value_t* value = (til_value_t*)malloc(sizeof(til_value_t));
-    if (value)
+    TIL_INTERN_STRING,
+    TIL_INTERN_NUMBERS,
+    TIL_INTERN_VALUES,
+    TIL_INTERN_CELLS,
+} til_intern_kind_t;
+
+struct til_intern_t
+{
+    unsigned    hash;
+    int         kind;
+    int         length;
+    const void* storage;
+};
+
+static unsigned hash_bytes(unsigned hash, const void* data, int size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+
+    int i;
+    for (i = 0; i < size; i++)
     {
-        value->type         = type;
-        value->table.length = 0;
-        value->table.values = NULL;
+        hash = (hash ^ bytes[i]) * 16777619u;
     }
-    return value;
+    return hash;
 }
 
-static void free_value(til_state_t* state, til_value_t* value)
+/* Spans and flags are not part of the content */
+static unsigned hash_value(unsigned hash, const til_value_t* value)
 {
-    if (value)
+    hash = hash_bytes(hash, &value->type, sizeof(value->type));
+    switch (value->type)
     {
-        free(value);
+    case TIL_NUMBER:
+        return hash_bytes(hash, &value->number, sizeof(value->number));
+
+    case TIL_BOOLEAN:
+        return hash_bytes(hash, &value->boolean, sizeof(value->boolean));
+
+    case TIL_STRING:
+        return hash_bytes(hash, &value->string.buffer, sizeof(value->string.buffer));
+
+    case TIL_ARRAY:
+        hash = hash_bytes(hash, &value->array.kind, sizeof(value->array.kind));
+        hash = hash_bytes(hash, &value->array.length, sizeof(value->array.length));
+        return hash_bytes(hash, &value->array.values, sizeof(value->array.values));
+
+    case TIL_TABLE:
+        hash = hash_bytes(hash, &value->table.length, sizeof(value->table.length));
+        return hash_bytes(hash, &value->table.values, sizeof(value->table.values));
+
+    default:
+        return hash;
     }
 }
 
-static til_value_t* skip_space_and_comment(til_state_t* state)
+static int equal_value(const til_value_t* a, const til_value_t* b)
 {
-    if (skip_space(state) == '-')
+    if (a->type != b->type)
     {
-        if (!is_eof(state) && state->buffer[state->cursor + 1] == '-')
-        {
-            next_line(state);
-        }
+        return 0;
     }
-    return  peek_char(state);
-}
 
-static til_value_t* parse_table(til_state_t* state);
-static til_value_t* parse_array(til_state_t* state);
-static til_value_t* parse_number(til_state_t* state);
-static til_value_t* parse_string(til_state_t* state);
-static til_value_t* parse_single(til_state_t* state);
-static til_value_t* parse_symbol(til_state_t* state);
+    switch (a->type)
+    {
+    case TIL_NUMBER:
+        return memcmp(&a->number, &b->number, sizeof(a->number)) == 0;
+
+    case TIL_BOOLEAN:
+        return a->boolean == b->boolean;
+
+    case TIL_STRING:
+        return a->string.buffer == b->string.buffer;
+
+    case TIL_ARRAY:
+        return a->array.kind == b->array.kind && a->array.length == b->array.length && a->array.values == b->array.values;
+
+    case TIL_TABLE:
+        return a->table.length == b->table.length && a->table.values == b->table.values;
+
+    default:
+        return 1;
+    }
+}
 
-static til_value_t* parse_number(til_state_t* state)
+/* Hash of the elements as they are pushed on the scratch buffer */
+static unsigned hash_items(int kind, const void* items, int length)
 {
-    if (skip_space(state) < 0)
+    unsigned hash = hash_bytes(2166136261u, &kind, sizeof(kind));
+
+    int i;
+    switch (kind)
     {
-		return NULL;
+    case TIL_INTERN_STRING:
+        return hash_bytes(hash, items, length);
+
+    case TIL_INTERN_NUMBERS:
+        for (i = 0; i < length; i++)
+        {
+            hash = hash_bytes(hash, &((const til_value_t*)items)[i].number, sizeof(double));
+        }
+        return hash;
+
+    case TIL_INTERN_VALUES:
+        for (i = 0; i < length; i++)
+        {
+            hash = hash_value(hash, &((const til_value_t*)items)[i]);
+        }
+        return hash;
+
+    case TIL_INTERN_CELLS:
+        for (i = 0; i < length; i++)
+        {
+            hash = hash_value(hash, &((const til_cell_t*)items)[i].name);
+            hash = hash_value(hash, &((const til_cell_t*)items)[i].value);
+        }
+        return hash;
+
+    default:
+        return hash;
     }
-    else
+}
+
+static int equal_items(int kind, const void* items, const void* storage, int length)
+{
+    int i;
+    switch (kind)
     {
-		int c = peek_char(state);
-		int sign = 1;
-		
-		if (c == '+')
-		{
-			c = next_char(state);
-            return NULL;
-			//croak(state, JSON_ERROR_UNEXPECTED,
-			//	  "JSON does not support number start with '+'");
-		}
-		else if (c == '-')
-		{
-			sign = -1;
-			c = next_char(state);
-		}
-		else if (c == '0')
-		{
-			c = next_char(state);
-			if (!isspace(c) && !ispunct(c))
-			{
-                return NULL;
-				//croak(state, JSON_ERROR_UNEXPECTED,
-				//	  "JSON does not support number start with '0'"
-				//	  " (only standalone '0' is accepted)");
-			}
-		}
-		else if (!isdigit(c))
-		{
-            return NULL;
-			//croak(state, JSON_ERROR_UNEXPECTED, "Unexpected '%c'", c);
-		}
+    case TIL_INTERN_STRING:
+        return memcmp(items, storage, length) == 0;
 
-		int    dot    = 0;
-		int    dotchk = 1;
-		int    numpow = 1;
-		double number = 0;
+    case TIL_INTERN_NUMBERS:
+        for (i = 0; i < length; i++)
+        {
+            if (memcmp(&((const til_value_t*)items)[i].number, &((const double*)storage)[i], sizeof(double)) != 0)
+            {
+                return 0;
+            }
+        }
+        return 1;
 
-		while (c > 0)
-		{
-			if (c == '.')
-			{
-				if (dot)
-				{
-                    return NULL;
-					//croak(state, JSON_ERROR_UNEXPECTED,
-					//      "Too many '.' are presented");
-				}
+    case TIL_INTERN_VALUES:
+        for (i = 0; i < length; i++)
+        {
+            if (!equal_value(&((const til_value_t*)items)[i], &((const til_value_t*)storage)[i]))
+            {
+                return 0;
+            }
+        }
+        return 1;
 
-				if (!dotchk)
-				{
+    case TIL_INTERN_CELLS:
+        for (i = 0; i < length; i++)
+        {
+            const til_cell_t* a = &((const til_cell_t*)items)[i];
+            const til_cell_t* b = &((const til_cell_t*)storage)[i];
+            if (!equal_value(&a->name, &b->name) || !equal_value(&a->value, &b->value))
+            {
+                return 0;
+            }
+        }
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+/* Returns the slot of an identical storage, or the empty slot to add it to */
+static til_intern_t* intern_find(til_state_t* state, unsigned hash, int kind, const void* items, int length)
+{
+    int mask  = state->intern_capacity - 1;
+    int index = (int)(hash & (unsigned)mask);
+    while (1)
+    {
+        til_intern_t* slot = &state->interned[index];
+        if (!slot->storage)
+        {
+            return slot;
+        }
+        else if (slot->hash == hash && slot->kind == kind && slot->length == length
+                 && equal_items(kind, items, slot->storage, length))
+        {
+            return slot;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static til_bool_t intern_reserve(til_state_t* state)
+{
+    if ((state->intern_count + 1) * 2 <= state->intern_capacity)
+    {
+        return TIL_TRUE;
+    }
+
+    int           capacity = state->intern_capacity > 0 ? state->intern_capacity * 2 : 1024;
+    til_intern_t* old      = state->interned;
+    int           count    = state->intern_capacity;
+
+    state->interned = (til_intern_t*)calloc(capacity, sizeof(til_intern_t));
+    if (!state->interned)
+    {
+        state->interned = old;
+        return TIL_FALSE;
+    }
+    state->intern_capacity = capacity;
+
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if (old[i].storage)
+        {
+            *intern_find(state, old[i].hash, -1, NULL, 0) = old[i];
+        }
+    }
+
+    free(old);
+    return TIL_TRUE;
+}
+
+/* Storage for length elements of kind, size bytes long. found is set when an
+ * identical storage already exists, otherwise the caller fills the new one.
+ * items are in scratch layout.
+ */
+static void* intern_storage(til_state_t* state, int kind, const void* items, int length, int size, int* found)
+{
+    unsigned      hash = hash_items(kind, items, length);
+    til_intern_t* slot = intern_reserve(state) ? intern_find(state, hash, kind, items, length) : NULL;
+    if (slot && slot->storage)
+    {
+        state->shared_count += 1;
+        state->shared_bytes += size;
+
+        *found = 1;
+        return (void*)slot->storage;
+    }
+
+    void* storage = arena_alloc(state, size);
+    if (storage && slot)
+    {
+        slot->hash    = hash;
+        slot->kind    = kind;
+        slot->length  = length;
+        slot->storage = storage;
+        state->intern_count++;
+    }
+
+    *found = 0;
+    return storage;
+}
+
+static til_value_t* make_value(til_value_t* value, til_type_t type)
+{
+    value->type         = type;
+    value->flags        = 0;
+    value->span.start   = -1;
+    value->span.end     = -1;
+    value->array.length = 0;
+    value->array.kind   = TIL_ARRAY_VALUES;
+    value->array.values = NULL;
+    return value;
+}
+
+static char* make_string(til_state_t* state, const char* buffer, int length)
+{
+    int   found  = 0;
+    char* string = state->hashcons
+        ? (char*)intern_storage(state, TIL_INTERN_STRING, buffer, length, length + 1, &found)
+        : (char*)arena_alloc(state, length + 1);
+    if (string && !found)
+    {
+        memcpy(string, buffer, length * sizeof(char));
+        string[length] = 0;
+    }
+    return string;
+}
+
+static int skip_space_and_comment(til_state_t* state)
+{
+    while (skip_space(state) == '-' && state->cursor + 1 < state->length && state->buffer[state->cursor + 1] == '-')
+    {
+        next_line(state);
+    }
+    return  peek_char(state);
+}
+
+/* Same as skip_space_and_comment, on raw source offsets */
+static int scan_trivia(const char* buffer, int cursor, int length)
+{
+    while (cursor < length)
+    {
+        if (isspace((unsigned char)buffer[cursor]))
+        {
+            cursor++;
+        }
+        else if (buffer[cursor] == '-' && cursor + 1 < length && buffer[cursor + 1] == '-')
+        {
+            while (cursor < length && buffer[cursor] != '\n')
+            {
+                cursor++;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    return cursor;
+}
+
+static til_value_t* parse_table(til_state_t* state, til_value_t* value);
+static til_value_t* parse_array(til_state_t* state, til_value_t* value);
+static til_value_t* parse_number(til_state_t* state, til_value_t* value);
+static til_value_t* parse_string(til_state_t* state, til_value_t* value);
+static til_value_t* parse_single(til_state_t* state, til_value_t* value);
+static til_value_t* parse_symbol(til_state_t* state, til_value_t* value);
+
+static const double powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* Correctly rounded value of a number token, the buffer may go on after it */
+static til_bool_t decimal_value(const char* token, int length, double* number)
+{
+    char  local[128];
+    char* copy = length < (int)sizeof(local) ? local : (char*)malloc(length + 1);
+    if (!copy)
+    {
+        return TIL_FALSE;
+    }
+
+    memcpy(copy, token, length);
+    copy[length] = 0;
+    *number = strtod(copy, NULL);
+
+    if (copy != local)
+    {
+        free(copy);
+    }
+    return TIL_TRUE;
+}
+
+static til_value_t* parse_number(til_state_t* state, til_value_t* value)
+{
+    if (skip_space(state) < 0)
+    {
+		return NULL;
+    }
+    else
+    {
+		int c = peek_char(state);
+		int sign = 1;
+		int start = state->cursor;
+		
+		if (c == '+')
+		{
+			c = next_char(state);
+            return NULL;
+			//croak(state, JSON_ERROR_UNEXPECTED,
+			//	  "JSON does not support number start with '+'");
+		}
+		else if (c == '-')
+		{
+			sign = -1;
+			c = next_char(state);
+		}
+		else if (c == '0')
+		{
+			c = next_char(state);
+			if (!isspace(c) && !ispunct(c))
+			{
+                return NULL;
+				//croak(state, JSON_ERROR_UNEXPECTED,
+				//	  "JSON does not support number start with '0'"
+				//	  " (only standalone '0' is accepted)");
+			}
+		}
+		else if (!isdigit(c))
+		{
+            return NULL;
+			//croak(state, JSON_ERROR_UNEXPECTED, "Unexpected '%c'", c);
+		}
+
+		int    dot    = 0;
+		int    dotchk = 1;
+		int    digits = 0;
+		int    scale  = 0;
+		double number = 0;
+
+		while (c > 0)
+		{
+			if (c == '.')
+			{
+				if (dot)
+				{
+                    return NULL;
+					//croak(state, JSON_ERROR_UNEXPECTED,
+					//      "Too many '.' are presented");
+				}
+
+				if (!dotchk)
+				{
 					//croak(state, JSON_ERROR_UNEXPECTED, "Unexpected '%c'", c);
                     return NULL;
 				}
@@ -294,7 +1075,6 @@ static til_value_t* parse_number(til_state_t* state)
 				{
 					dot    = 1;
 					dotchk = 0;
-					numpow = 1;
 				}
 			}
 			else if (!isdigit(c))
@@ -304,15 +1084,9 @@ static til_value_t* parse_number(til_state_t* state)
 			else
 			{
 				dotchk = 1;
-				if (dot)
-				{
-					numpow *= 10;
-					number += (c - '0') / (double)numpow;
-				}
-				else
-				{
-					number = number * 10 + (c - '0');
-				}
+				digits = digits + 1;
+				scale  = scale + dot;
+				number = number * 10 + (c - '0');
 			}
 
 			c = next_char(state);
@@ -327,14 +1101,78 @@ static til_value_t* parse_number(til_state_t* state)
 		}
 		else
 		{
-			til_value_t* value = make_value(state, TIL_NUMBER);
-			value->number = sign * number;
+			make_value(value, TIL_NUMBER);
+
+			/* Exact when the digits and the power of ten fit a double */
+			if (digits <= 15 && scale <= 22)
+			{
+				value->number = sign * number / powers_of_ten[scale];
+			}
+			else if (!decimal_value(state->buffer + start, state->cursor - start, &value->number))
+			{
+				return NULL;
+			}
 			return value;
 		}
     }
 }
 
-static til_value_t* parse_array(til_state_t* state)
+/* Moves the elements pushed on scratch since base into the array */
+static til_value_t* finish_array(til_state_t* state, til_value_t* value, int base, int length, int packed)
+{
+    const til_value_t* items = (const til_value_t*)(state->scratch.data + base);
+    state->scratch.count = base;
+
+    make_value(value, TIL_ARRAY);
+    value->array.length = length;
+
+    int found = 0;
+    if (length > 0 && packed)
+    {
+        int     size    = length * sizeof(double);
+        double* numbers = state->hashcons
+            ? (double*)intern_storage(state, TIL_INTERN_NUMBERS, items, length, size, &found)
+            : (double*)arena_alloc(state, size);
+        if (!numbers)
+        {
+            return NULL;
+        }
+
+        int i;
+        for (i = 0; i < length && !found; i++)
+        {
+            numbers[i] = items[i].number;
+        }
+
+        value->array.kind    = TIL_ARRAY_NUMBERS;
+        value->array.numbers = numbers;
+    }
+    else if (length > 0)
+    {
+        int          size   = length * sizeof(til_value_t);
+        til_value_t* values = state->hashcons
+            ? (til_value_t*)intern_storage(state, TIL_INTERN_VALUES, items, length, size, &found)
+            : (til_value_t*)arena_alloc(state, size);
+        if (!values)
+        {
+            return NULL;
+        }
+
+        if (!found)
+        {
+            memcpy(values, items, size);
+        }
+        value->array.values = values;
+    }
+
+    if (state->hashcons)
+    {
+        value->flags |= TIL_FLAG_SHARED;
+    }
+    return value;
+}
+
+static til_value_t* parse_array(til_state_t* state, til_value_t* value)
 {
     if (skip_space_and_comment(state) != '[')
     {
@@ -345,8 +1183,10 @@ static til_value_t* parse_array(til_state_t* state)
         next_char(state);
     }
 
-    int          length = 0;
-    til_value_t* values = NULL;
+    int base   = state->scratch.count;
+    int length = 0;
+    int packed = 1;
+    int lead   = state->cursor;
     while (!(skip_space_and_comment(state) <= 0 || peek_char(state) == ']'))
     {
         if (length > 0)
@@ -354,6 +1194,7 @@ static til_value_t* parse_array(til_state_t* state)
             if (skip_space_and_comment(state) == ',')
             {
                 next_char(state);
+                lead = state->cursor;
             }
             else
             {
@@ -362,13 +1203,21 @@ static til_value_t* parse_array(til_state_t* state)
         }
 
         // Parse value
-        til_value_t* value = parse_single(state);
-        assert(value != NULL && "value cannot be null, checking parse_single()");
+        til_value_t item;
+        if (!parse_single(state, &item))
+        {
+            return NULL;
+        }
 
-        length = length + 1;
-        values = realloc(values, length * sizeof(values[0]));
+        item.span.start = lead;
+        item.span.end   = state->cursor;
+        if (!scratch_push(state, &item, sizeof(item)))
+        {
+            return NULL;
+        }
 
-        values[length - 1] = *value;
+        packed = packed && item.type == TIL_NUMBER;
+        length = length + 1;
     }
 
     if (peek_char(state) != ']')
@@ -379,14 +1228,11 @@ static til_value_t* parse_array(til_state_t* state)
     {
         next_char(state);
 
-        til_value_t* value  = make_value(state, TIL_ARRAY);
-        value->array.length = length;
-        value->array.values = values;
-        return value;
+        return finish_array(state, value, base, length, packed);
     }
 }
 
-static til_value_t* parse_single(til_state_t* state)
+static til_value_t* parse_single(til_state_t* state, til_value_t* value)
 {
     if (skip_space_and_comment(state) > 0)
     {
@@ -395,19 +1241,25 @@ static til_value_t* parse_single(til_state_t* state)
         switch (c)
         {
         case '{':
-            return parse_table(state);
-            
         case '[':
-            return parse_array(state);
+            if (state->depth >= state->max_depth)
+            {
+                return NULL;
+            }
+
+            state->depth++;
+            value = c == '{' ? parse_table(state, value) : parse_array(state, value);
+            state->depth--;
+            return value;
             
         case '"':
-            return parse_string(state);
+            return parse_string(state, value);
 
         case '-': case '+': case '0':
         case '1': case '2': case '3':
         case '4': case '5': case '6':
         case '7': case '8': case '9':
-            return parse_number(state);
+            return parse_number(state, value);
         }
 
         if (isalpha(c))
@@ -421,20 +1273,19 @@ static til_value_t* parse_single(til_state_t* state)
             }
 
             const char* token = state->buffer + state->cursor - len;
-            if (len == 3 && strncmp(token, "nil", len))
+            if (len == 3 && strncmp(token, "nil", len) == 0)
             {
-                til_value_t* value = make_value(state, TIL_NIL);
-                return value;
+                return make_value(value, TIL_NIL);
             }
-            else if (len == 4 && strncmp(token, "true", len))
+            else if (len == 4 && strncmp(token, "true", len) == 0)
             {
-                til_value_t* value = make_value(state, TIL_BOOLEAN);
+                make_value(value, TIL_BOOLEAN);
                 value->boolean = TIL_TRUE;
                 return value;
             }
-            else if (len == 5 && strncmp(token, "false", len))
+            else if (len == 5 && strncmp(token, "false", len) == 0)
             {
-                til_value_t* value = make_value(state, TIL_BOOLEAN);
+                make_value(value, TIL_BOOLEAN);
                 value->boolean = TIL_FALSE;
                 return value;
             }
@@ -454,14 +1305,14 @@ static til_value_t* parse_single(til_state_t* state)
     }
 }
 
-static til_value_t* parse_string(til_state_t* state)
+static til_value_t* parse_string(til_state_t* state, til_value_t* value)
 {
     if (skip_space_and_comment(state) != '"')
     {
         return NULL;
     }
 
-    int len = 1;
+    int len = 0;
     int chr = next_char(state);
     while (chr > 0 && chr != '"')
     {
@@ -477,18 +1328,14 @@ static til_value_t* parse_string(til_state_t* state)
     {
         next_char(state);
 
-        til_value_t* value = make_value(state, TIL_STRING);
+        make_value(value, TIL_STRING);
         value->string.length = len;
-        value->string.buffer = malloc((len + 1) * sizeof(char));
-        
-        value->string.buffer[len] = 0;
-        memcpy(value->string.buffer, state->buffer + state->cursor - len, len);
-
-        return value;
+        value->string.buffer = make_string(state, state->buffer + state->cursor - len - 1, len);
+        return value->string.buffer ? value : NULL;
     }
 }
 
-static til_value_t* parse_symbol(til_state_t* state)
+static til_value_t* parse_symbol(til_state_t* state, til_value_t* value)
 {
     if (isalpha(skip_space(state)) || peek_char(state) == '_')
     {
@@ -500,14 +1347,10 @@ static til_value_t* parse_symbol(til_state_t* state)
             chr = next_char(state);
         }
 
-        til_value_t* value   = make_value(state, TIL_STRING);
+        make_value(value, TIL_STRING);
         value->string.length = len;
-        value->string.buffer = malloc((len + 1) * sizeof(char));
-        
-        value->string.buffer[len] = 0;
-        memcpy(value->string.buffer, state->buffer + state->cursor - len, len * sizeof(char));
-
-        return value;
+        value->string.buffer = make_string(state, state->buffer + state->cursor - len, len);
+        return value->string.buffer ? value : NULL;
     }
     else
     {
@@ -515,329 +1358,4002 @@ static til_value_t* parse_symbol(til_state_t* state)
     }
 }
 
-static til_value_t* parse_table(til_state_t* state)
+/* Moves the cells pushed on scratch since base into the table */
+static til_value_t* finish_table(til_state_t* state, til_value_t* value, int base, int length)
 {
-    if (skip_space_and_comment(state) != '{')
-    {
-        return NULL;
-    }
-    else
-    {
-        next_char(state);
-    }
+    const til_cell_t* cells = (const til_cell_t*)(state->scratch.data + base);
+    state->scratch.count = base;
 
-    int         length = 0;
-    til_cell_t* values = NULL;
-    while (!(skip_space_and_comment(state) <= 0 || peek_char(state) == '}'))
+    make_value(value, TIL_TABLE);
+    value->table.length = length;
+
+    if (length > 0)
     {
-        // Parse name
-        til_value_t* name = NULL;
-        int c = peek_char(state);
-        if (isalpha(c))
-        {                                      
-            name = parse_symbol(state);
-            assert(name->type == TIL_STRING);
-        }
-        else if (c == '[')
-        {
-            next_char(state);
-            name = parse_string(state);
-            assert(!name || name->type == TIL_STRING);
-            
-            if (!name)
-            {
-                return NULL;
-            }
-            else if (skip_space(state) != ']')
-            {
-                return NULL;
-            }
-            else
-            {
-                next_char(state);
-            }
-        }
-        else
+        int found = 0;
+        int size  = length * sizeof(til_cell_t);
+        value->table.values = state->hashcons
+            ? (til_cell_t*)intern_storage(state, TIL_INTERN_CELLS, cells, length, size, &found)
+            : (til_cell_t*)arena_alloc(state, size);
+        if (!value->table.values)
         {
             return NULL;
         }
 
-        if (skip_space_and_comment(state) == '=')
+        if (!found)
         {
-            next_char(state);
+            memcpy(value->table.values, cells, size);
         }
-        else
+    }
+
+    /* Every container but the root sits in interned storage, empty ones included */
+    if (state->hashcons)
+    {
+        value->flags |= TIL_FLAG_SHARED;
+    }
+    return value;
+}
+
+/* Name of a table cell, a symbol or ["string"] */
+static til_value_t* parse_name(til_state_t* state, til_value_t* name)
+{
+    int c = peek_char(state);
+    if (isalpha(c))
+    {                                      
+        return parse_symbol(state, name);
+    }
+    else if (c == '[')
+    {
+        next_char(state);
+        if (!parse_string(state, name))
         {
             return NULL;
         }
-
-        // Parse value
-        til_value_t* value = parse_single(state);
-        assert(value != NULL && "value cannot be null, checking parse_single()");
-
-        if (skip_space(state) == ';')
+        else if (skip_space(state) != ']')
         {
-            next_char(state);
+            return NULL;
         }
         else
         {
-            return NULL;
+            next_char(state);
+            return name;
         }
-
-        length = length + 1;
-        values = realloc(values, length * sizeof(til_cell_t));
-
-        values[length - 1].name  = *name;
-        values[length - 1].value = *value;
+    }
+    else
+    {
+        return NULL;
+    }
+}
+
+static til_value_t* parse_table(til_state_t* state, til_value_t* value)
+{
+    if (skip_space_and_comment(state) != '{')
+    {
+        return NULL;
+    }
+    else
+    {
+        next_char(state);
+    }
+
+    int base   = state->scratch.count;
+    int length = 0;
+    int lead   = state->cursor;
+    while (!(skip_space_and_comment(state) <= 0 || peek_char(state) == '}'))
+    {
+        til_cell_t cell;
+
+        // Parse name
+        if (!parse_name(state, &cell.name))
+        {
+            return NULL;
+        }
+
+        cell.name.span.start = lead;
+        cell.name.span.end   = state->cursor;
+
+        if (skip_space_and_comment(state) == '=')
+        {
+            next_char(state);
+            lead = state->cursor;
+        }
+        else
+        {
+            return NULL;
+        }
+
+        // Parse value
+        if (!parse_single(state, &cell.value))
+        {
+            return NULL;
+        }
+
+        cell.value.span.start = lead;
+        cell.value.span.end   = state->cursor;
+
+        if (skip_space(state) == ';')
+        {
+            next_char(state);
+            lead = state->cursor;
+        }
+        else
+        {
+            return NULL;
+        }
+
+        if (!scratch_push(state, &cell, sizeof(cell)))
+        {
+            return NULL;
+        }
+        length = length + 1;
     }
 
     if (peek_char(state) != '}')
     {
-        return NULL;
+        return NULL;
+    }
+    else
+    {
+        next_char(state);
+
+        return finish_table(state, value, base, length);
+    }
+}
+
+/*
+ * Iterative driver, used unless TIL_PARSE_RECURSIVE is given: same grammar
+ * and trees as the functions above, with the open containers kept in
+ * state->frames so the native stack does not grow with nesting.
+ */
+
+typedef struct til_frame_t
+{
+    int        type;    /* TIL_TABLE or TIL_ARRAY */
+    int        base;    /* scratch offset of the elements */
+    int        length;
+    int        packed;
+    int        lead;    /* start of the current element, leading trivia included */
+    til_cell_t cell;    /* table: cell whose value is being parsed */
+} til_frame_t;
+
+static til_frame_t* push_frame(til_state_t* state, int type)
+{
+    if (state->frames.count / (int)sizeof(til_frame_t) >= state->max_depth)
+    {
+        return NULL;
+    }
+
+    next_char(state);
+
+    til_frame_t frame;
+    frame.type   = type;
+    frame.base   = state->scratch.count;
+    frame.length = 0;
+    frame.packed = 1;
+    frame.lead   = state->cursor;
+    return (til_frame_t*)buffer_push(&state->frames, &frame, sizeof(frame));
+}
+
+/* Adds a finished value to the container on top of the stack */
+static til_bool_t add_element(til_state_t* state, til_frame_t* frame, til_value_t* value)
+{
+    value->span.start = frame->lead;
+    value->span.end   = state->cursor;
+
+    if (frame->type == TIL_ARRAY)
+    {
+        if (!scratch_push(state, value, sizeof(til_value_t)))
+        {
+            return TIL_FALSE;
+        }
+        frame->packed = frame->packed && value->type == TIL_NUMBER;
+    }
+    else
+    {
+        if (skip_space(state) != ';')
+        {
+            return TIL_FALSE;
+        }
+
+        next_char(state);
+        frame->cell.value = *value;
+        if (!scratch_push(state, &frame->cell, sizeof(til_cell_t)))
+        {
+            return TIL_FALSE;
+        }
+    }
+
+    frame->length += 1;
+    frame->lead    = state->cursor;
+    return TIL_TRUE;
+}
+
+static til_value_t* parse_iterative(til_state_t* state, til_value_t* root)
+{
+    if (skip_space_and_comment(state) != '{' || !push_frame(state, TIL_TABLE))
+    {
+        return NULL;
+    }
+
+    while (state->frames.count > 0)
+    {
+        til_frame_t* frame = (til_frame_t*)(state->frames.data + state->frames.count) - 1;
+        til_value_t  value;
+
+        int c = skip_space_and_comment(state);
+        if (c <= 0 || c == (frame->type == TIL_TABLE ? '}' : ']'))
+        {
+            if (c <= 0)
+            {
+                return NULL;
+            }
+
+            // Close the container, hand it to its parent
+            next_char(state);
+            if (frame->type == TIL_TABLE
+                ? !finish_table(state, &value, frame->base, frame->length)
+                : !finish_array(state, &value, frame->base, frame->length, frame->packed))
+            {
+                return NULL;
+            }
+
+            state->frames.count -= sizeof(til_frame_t);
+            if (state->frames.count == 0)
+            {
+                *root = value;
+                return root;
+            }
+            else if (!add_element(state, frame - 1, &value))
+            {
+                return NULL;
+            }
+            continue;
+        }
+
+        if (frame->type == TIL_TABLE)
+        {
+            // Parse name
+            if (!parse_name(state, &frame->cell.name))
+            {
+                return NULL;
+            }
+
+            frame->cell.name.span.start = frame->lead;
+            frame->cell.name.span.end   = state->cursor;
+
+            if (skip_space_and_comment(state) != '=')
+            {
+                return NULL;
+            }
+
+            next_char(state);
+            frame->lead = state->cursor;
+        }
+        else if (frame->length > 0)
+        {
+            if (c != ',')
+            {
+                return NULL;
+            }
+
+            next_char(state);
+            frame->lead = state->cursor;
+        }
+
+        // Parse value, containers are opened and filled by the next iterations
+        c = skip_space_and_comment(state);
+        if (c == '{' || c == '[')
+        {
+            if (!push_frame(state, c == '{' ? TIL_TABLE : TIL_ARRAY))
+            {
+                return NULL;
+            }
+        }
+        else if (!parse_single(state, &value) || !add_element(state, frame, &value))
+        {
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/* The intern table only lives while parsing */
+static void free_interned(til_state_t* state)
+{
+    free(state->interned);
+    state->interned        = NULL;
+    state->intern_count    = 0;
+    state->intern_capacity = 0;
+    state->hashcons        = 0;
+}
+
+static til_state_t* root_state = NULL;
+
+/* @funcdef: til_parse */
+til_value_t* til_parse(const char* code, til_state_t** out_state)
+{
+    return til_parse_ex(code, NULL, out_state);
+}
+
+/* @funcdef: til_parse_ex */
+til_value_t* til_parse_ex(const char* code, const til_options_t* options, til_state_t** out_state)
+{
+    til_state_t* state = make_state(code);
+    if (!state)
+    {
+        return NULL;
+    }
+
+    int flags = options ? options->flags : TIL_PARSE_DEFAULT;
+
+    state->hashcons  = (flags & TIL_PARSE_HASHCONS) != 0;
+    state->max_depth = options && options->max_depth > 0 ? options->max_depth : TIL_MAX_DEPTH;
+    state->depth     = 1;
+
+    til_value_t* value = NULL;
+    if (skip_space_and_comment(state) == '{')
+    {
+        value = (til_value_t*)arena_alloc(state, sizeof(til_value_t));
+        if (value)
+        {
+            value = (flags & TIL_PARSE_RECURSIVE) ? parse_table(state, value) : parse_iterative(state, value);
+        }
+
+        if (value)
+        {
+            state->root       = value;
+            value->span.start = 0;
+            value->span.end   = state->cursor;
+
+            /* Nothing else can be identical to the root, keep it mutable */
+            value->flags &= ~TIL_FLAG_SHARED;
+        }
+    }
+
+    free_interned(state);
+
+    if (value)
+    {
+        if (out_state)
+        {
+            *out_state = state;
+        }
+        else
+        {
+            state->next = root_state;
+            root_state  = state;
+        }
+        return value;
+    }
+    else
+    {
+        if (out_state)
+        {
+            *out_state = NULL;
+        }
+        free_state(state);
+        return NULL;
+    }
+}
+
+/* @funcdef: til_stats */
+void til_stats(const til_state_t* state, til_stats_t* stats)
+{
+    if (!stats)
+    {
+        return;
+    }
+
+    stats->allocated    = 0;
+    stats->shared       = 0;
+    stats->shared_count = 0;
+
+    if (state)
+    {
+        const til_block_t* block;
+        for (block = state->blocks; block; block = block->next)
+        {
+            stats->allocated += block->used;
+        }
+
+        stats->shared       = state->shared_bytes;
+        stats->shared_count = state->shared_count;
+    }
+}
+
+/* @funcdef: til_release */
+void til_release(til_state_t* state)
+{
+    if (state)
+    {
+        if (til_atomic_add(&state->refs, -1) == 1)
+        {
+            free_state(state);
+        }
+    }
+    else
+    {
+        while (root_state)
+        {
+            til_state_t* next = root_state->next;
+            til_release(root_state);
+            root_state = next;
+        }
+    }
+}
+
+/* @funcdef: til_retain */
+til_state_t* til_retain(til_state_t* state)
+{
+    if (state)
+    {
+        til_atomic_add(&state->refs, 1);
+    }
+    return state;
+}
+
+/* @funcdef: til_array_numbers */
+const double* til_array_numbers(const til_value_t* value)
+{
+    if (value && value->type == TIL_ARRAY && value->array.kind == TIL_ARRAY_NUMBERS)
+    {
+        return value->array.numbers;
+    }
+    else
+    {
+        return NULL;
+    }
+}
+
+/* @funcdef: til_array_get */
+til_value_t til_array_get(const til_value_t* value, int index)
+{
+    til_value_t result;
+    make_value(&result, TIL_NIL);
+
+    if (value && value->type == TIL_ARRAY && index >= 0 && index < value->array.length)
+    {
+        if (value->array.kind == TIL_ARRAY_NUMBERS)
+        {
+            make_value(&result, TIL_NUMBER);
+            result.number = value->array.numbers[index];
+        }
+        else
+        {
+            result = value->array.values[index];
+        }
+    }
+    return result;
+}
+
+/* Numbers are written with the shortest digits that parse back to the same
+ * value, in positional notation as TIL has no exponent (at most 350 bytes).
+ */
+static int format_code_number(char* buffer, double number)
+{
+    if (number - number != 0)
+    {
+        return sprintf(buffer, "%.15g", number);
+    }
+
+    char       digits[24];
+    int        count     = 0;
+    int        point;   /* digits before the point */
+    til_bool_t negative  = number < 0 || (number == 0 && 1.0 / number < 0) ? TIL_TRUE : TIL_FALSE;
+    double     magnitude = negative ? -number : number;
+
+    /* Most numbers have few decimals: for the smallest k where magnitude * 10^k
+     * rounds to an integer n below 2^53 and n / 10^k == magnitude, the digits
+     * of n are the shortest and converted without libc.
+     */
+    int k;
+    for (k = 0; k <= 17 && magnitude * powers_of_ten[k] < 9007199254740992.0; k++)
+    {
+        unsigned long long integer = (unsigned long long)(magnitude * powers_of_ten[k] + 0.5);
+        if ((double)integer / powers_of_ten[k] == magnitude)
+        {
+            do
+            {
+                digits[count++] = (char)('0' + integer % 10);
+                integer /= 10;
+            } while (integer > 0);
+
+            int i;
+            for (i = 0; i < count / 2; i++)
+            {
+                char c                = digits[i];
+                digits[i]             = digits[count - 1 - i];
+                digits[count - 1 - i] = c;
+            }
+            point = count - k;
+            break;
+        }
+    }
+
+    if (count == 0)
+    {
+        char scientific[32];
+        int  precision = 14;
+
+        sprintf(scientific, "%.*e", precision, magnitude);
+        while (precision < 16 && strtod(scientific, NULL) != magnitude)
+        {
+            sprintf(scientific, "%.*e", ++precision, magnitude);
+        }
+
+        /* d.ddde[+-]x into digits, without trailing zeros */
+        const char* exponent = strchr(scientific, 'e');
+        const char* c;
+        for (c = scientific; c < exponent; c++)
+        {
+            if (*c != '.')
+            {
+                digits[count++] = *c;
+            }
+        }
+        while (count > 1 && digits[count - 1] == '0')
+        {
+            count--;
+        }
+        point = atoi(exponent + 1) + 1;
+    }
+
+    int length = 0;
+    int i;
+
+    if (negative)
+    {
+        buffer[length++] = '-';
+    }
+
+    if (point <= 0)
+    {
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        for (i = 0; i < -point; i++)
+        {
+            buffer[length++] = '0';
+        }
+        memcpy(buffer + length, digits, count);
+        length += count;
+    }
+    else if (point >= count)
+    {
+        memcpy(buffer + length, digits, count);
+        length += count;
+        for (i = count; i < point; i++)
+        {
+            buffer[length++] = '0';
+        }
+    }
+    else
+    {
+        memcpy(buffer + length, digits, point);
+        length += point;
+        buffer[length++] = '.';
+        memcpy(buffer + length, digits + point, count - point);
+        length += count - point;
+    }
+
+    buffer[length] = 0;
+    return length;
+}
+
+/* Packed arrays are formatted into a local buffer and flushed in chunks,
+ * instead of one fprintf per token. JSON has no inf or nan, they are null.
+ */
+static void write_numbers(const double* numbers, int length, int indent, til_bool_t json, FILE* out)
+{
+    char buffer[4096];
+    int  count = 0;
+
+    int i;
+    for (i = 0; i < length; i++)
+    {
+        int j, m;
+        for (j = 0, m = indent * 4; j < m; j++)
+        {
+            if (count == (int)sizeof(buffer))
+            {
+                fwrite(buffer, 1, count, out);
+                count = 0;
+            }
+            buffer[count++] = ' ';
+        }
+
+        /* Room for the widest number, ',' and '\n' */
+        if (count > (int)sizeof(buffer) - 360)
+        {
+            fwrite(buffer, 1, count, out);
+            count = 0;
+        }
+
+        if (json && numbers[i] - numbers[i] != 0)
+        {
+            memcpy(buffer + count, "null", 4);
+            count += 4;
+        }
+        else
+        {
+            count += format_code_number(buffer + count, numbers[i]);
+        }
+        if (i < length - 1)
+        {
+            buffer[count++] = ',';
+        }
+        buffer[count++] = '\n';
+    }
+
+    fwrite(buffer, 1, count, out);
+}
+
+/* JSON escape of c (at most 6 bytes), 0 when c is written as is */
+static int json_escape(int c, char* buffer)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    buffer[0] = '\\';
+    switch (c)
+    {
+    case '"':  buffer[1] = '"';  return 2;
+    case '\\': buffer[1] = '\\'; return 2;
+    case '\b': buffer[1] = 'b';  return 2;
+    case '\f': buffer[1] = 'f';  return 2;
+    case '\n': buffer[1] = 'n';  return 2;
+    case '\r': buffer[1] = 'r';  return 2;
+    case '\t': buffer[1] = 't';  return 2;
+    }
+
+    if ((unsigned char)c < 0x20)
+    {
+        memcpy(buffer + 1, "u00", 3);
+        buffer[4] = hex[(c >> 4) & 15];
+        buffer[5] = hex[c & 15];
+        return 6;
+    }
+    return 0;
+}
+
+static void print_string(const char* string, int length, FILE* out)
+{
+    char escape[6];
+    int  start = 0;
+
+    int i;
+    fputc('"', out);
+    for (i = 0; i < length; i++)
+    {
+        int count = json_escape(string[i], escape);
+        if (count > 0)
+        {
+            fwrite(string + start, 1, i - start, out);
+            fwrite(escape, 1, count, out);
+            start = i + 1;
+        }
+    }
+    fwrite(string + start, 1, length - start, out);
+    fputc('"', out);
+}
+
+void til_print(const til_value_t* value, FILE* out)
+{
+    if (value)
+    {
+        int i, n;
+        static int indent = 0;
+
+        switch (value->type)
+        {
+        case TIL_NIL:
+            fprintf(out, "null");
+            break;
+
+        case TIL_NUMBER:
+            /* JSON has no inf or nan */
+            if (value->number - value->number == 0)
+            {
+                char number[400];
+                fwrite(number, 1, format_code_number(number, value->number), out);
+            }
+            else
+            {
+                fprintf(out, "null");
+            }
+            break;
+
+        case TIL_BOOLEAN:
+            fprintf(out, "%s", value->boolean ? "true" : "false");
+            break;
+
+        case TIL_STRING:
+            print_string(value->string.buffer, value->string.length, out);
+            break;
+
+        case TIL_ARRAY:
+            fprintf(out, "[\n");
+
+            indent++;
+            if (value->array.kind == TIL_ARRAY_NUMBERS)
+            {
+                write_numbers(value->array.numbers, value->array.length, indent, TIL_TRUE, out);
+            }
+            else
+            {
+                for (i = 0, n = value->array.length; i < n; i++)
+                {
+                    int j, m;
+                    for (j = 0, m = indent * 4; j < m; j++)
+                    {
+                        fprintf(out, " ");
+                    }
+
+                    til_print(&value->array.values[i], out);
+                    if (i < n - 1)
+                    {
+                        fprintf(out, ",");
+                    }
+                    fprintf(out, "\n");
+                }
+            }
+            indent--;
+
+            for (i = 0, n = indent * 4; i < n; i++)
+            {
+                fprintf(out, " ");
+            }
+            fprintf(out, "]");
+            break;
+
+        case TIL_TABLE:
+            fprintf(out, "{\n");
+
+            indent++;
+            for (i = 0, n = value->table.length; i < n; i++)
+            {
+                int j, m;
+                for (j = 0, m = indent * 4; j < m; j++)
+                {
+                    fprintf(out, " ");
+                }
+
+                til_print(&value->table.values[i].name, out);
+                fprintf(out, ": ");
+                til_print(&value->table.values[i].value, out);
+                if (i < n - 1)
+                {
+                    fprintf(out, ",");
+                }
+                fprintf(out, "\n");
+            }
+            indent--;
+
+            for (i = 0, n = indent * 4; i < n; i++)
+            {
+                fprintf(out, " ");
+            }
+            fprintf(out, "}");
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+static void write_name(const til_value_t* name, FILE* out);
+
+void til_write(const til_value_t* value, FILE* out)
+{
+    if (value)
+    {
+        int i, n;
+        static int indent = 0;
+        char number[400];
+
+        switch (value->type)
+        {
+        case TIL_NIL:
+            fprintf(out, "nil");
+            break;
+
+        case TIL_NUMBER:
+            fwrite(number, 1, format_code_number(number, value->number), out);
+            break;
+
+        case TIL_BOOLEAN:
+            fprintf(out, "%s", value->boolean ? "true" : "false");
+            break;
+
+        case TIL_STRING:
+            fprintf(out, "\"%s\"", value->string.buffer);
+            break;
+
+        case TIL_ARRAY:
+            fprintf(out, "[\n");
+
+            indent++;
+            if (value->array.kind == TIL_ARRAY_NUMBERS)
+            {
+                write_numbers(value->array.numbers, value->array.length, indent, TIL_FALSE, out);
+            }
+            else
+            {
+                for (i = 0, n = value->array.length; i < n; i++)
+                {
+                    int j, m;
+                    for (j = 0, m = indent * 4; j < m; j++)
+                    {
+                        fprintf(out, " ");
+                    }
+
+                    til_write(&value->array.values[i], out);
+                    if (i < n - 1)
+                    {
+                        fprintf(out, ",");
+                    }
+                    fprintf(out, "\n");
+                }
+            }
+            indent--;
+
+            for (i = 0, n = indent * 4; i < n; i++)
+            {
+                fprintf(out, " ");
+            }
+            fprintf(out, "]");
+            break;
+
+        case TIL_TABLE:
+            fprintf(out, "{\n");
+
+            indent++;
+            for (i = 0, n = value->table.length; i < n; i++)
+            {
+                int j, m;
+                for (j = 0, m = indent * 4; j < m; j++)
+                {
+                    fprintf(out, " ");
+                }
+
+                write_name(&value->table.values[i].name, out);
+                fprintf(out, " = ");
+                til_write(&value->table.values[i].value, out);
+                fprintf(out, ";\n");
+            }
+            indent--;
+
+            for (i = 0, n = indent * 4; i < n; i++)
+            {
+                fprintf(out, " ");
+            }
+            fprintf(out, "}");
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+/*
+ * Mutations
+ */
+
+static int is_symbol(const char* name, int length)
+{
+    int i;
+
+    if (length <= 0 || !isalpha((unsigned char)name[0]))
+    {
+        return 0;
+    }
+
+    for (i = 1; i < length; i++)
+    {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Storage that can grow in place keeps its capacity in the 8 bytes before it */
+static void* make_storage(til_state_t* state, til_value_t* container, int capacity, int elemsize)
+{
+    char* block = (char*)arena_alloc(state, 8 + capacity * elemsize);
+    if (!block)
+    {
+        return NULL;
+    }
+
+    *(int*)block = capacity;
+    container->flags |= TIL_FLAG_RESIZABLE;
+    return block + 8;
+}
+
+/* Returns storage with room for length + 1 elements, the old storage is left
+ * to the arena.
+ */
+static void* grow_storage(til_state_t* state, til_value_t* container, void* storage, int length, int elemsize)
+{
+    int capacity = (container->flags & TIL_FLAG_RESIZABLE) ? *(int*)((char*)storage - 8) : length;
+    if (length < capacity)
+    {
+        return storage;
+    }
+
+    void* new_storage = make_storage(state, container, capacity < 4 ? 4 : capacity * 2, elemsize);
+    if (new_storage && length > 0)
+    {
+        memcpy(new_storage, storage, length * elemsize);
+    }
+    return new_storage;
+}
+
+static til_value_t* copy_value(til_state_t* state, til_value_t* dst, const til_value_t* src)
+{
+    int i, n;
+
+    make_value(dst, src->type);
+    switch (src->type)
+    {
+    case TIL_NUMBER:
+        dst->number = src->number;
+        break;
+
+    case TIL_BOOLEAN:
+        dst->boolean = src->boolean;
+        break;
+
+    case TIL_STRING:
+        dst->string.length = src->string.length;
+        dst->string.buffer = make_string(state, src->string.buffer, src->string.length);
+        if (!dst->string.buffer)
+        {
+            return NULL;
+        }
+        break;
+
+    case TIL_ARRAY:
+        n = src->array.length;
+        if (n <= 0)
+        {
+            break;
+        }
+        else if (src->array.kind == TIL_ARRAY_NUMBERS)
+        {
+            dst->array.numbers = (double*)arena_alloc(state, n * sizeof(double));
+            if (!dst->array.numbers)
+            {
+                return NULL;
+            }
+
+            memcpy(dst->array.numbers, src->array.numbers, n * sizeof(double));
+        }
+        else
+        {
+            dst->array.values = (til_value_t*)arena_alloc(state, n * sizeof(til_value_t));
+            if (!dst->array.values)
+            {
+                return NULL;
+            }
+
+            for (i = 0; i < n; i++)
+            {
+                if (!copy_value(state, &dst->array.values[i], &src->array.values[i]))
+                {
+                    return NULL;
+                }
+            }
+        }
+        dst->array.kind   = src->array.kind;
+        dst->array.length = n;
+        break;
+
+    case TIL_TABLE:
+        n = src->table.length;
+        if (n <= 0)
+        {
+            break;
+        }
+
+        dst->table.values = (til_cell_t*)arena_alloc(state, n * sizeof(til_cell_t));
+        if (!dst->table.values)
+        {
+            return NULL;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (!copy_value(state, &dst->table.values[i].name, &src->table.values[i].name)
+                || !copy_value(state, &dst->table.values[i].value, &src->table.values[i].value))
+            {
+                return NULL;
+            }
+        }
+        dst->table.length = n;
+        break;
+
+    default:
+        break;
+    }
+    return dst;
+}
+
+/* Copies value into slot, taking over the source span of the value it replaces */
+static til_value_t* replace_value(til_state_t* state, til_value_t* slot, const til_value_t* value)
+{
+    til_value_t copy;
+    if (!copy_value(state, &copy, value))
+    {
+        return NULL;
+    }
+
+    copy.flags |= TIL_FLAG_MODIFIED;
+    copy.span   = slot->span;
+
+    *slot = copy;
+    return slot;
+}
+
+/* Packed arrays become arrays of values when a non-number is stored */
+static til_bool_t unpack_array(til_state_t* state, til_value_t* array)
+{
+    int i, n = array->array.length;
+
+    til_value_t* values = (til_value_t*)make_storage(state, array, n + 1, sizeof(til_value_t));
+    if (!values)
+    {
+        return TIL_FALSE;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        make_value(&values[i], TIL_NUMBER);
+        values[i].number = array->array.numbers[i];
+    }
+
+    array->array.kind   = TIL_ARRAY_VALUES;
+    array->array.values = values;
+    array->flags       |= TIL_FLAG_MODIFIED;
+    return TIL_TRUE;
+}
+
+/* Counts a mutation of container and remembers where it is in the source:
+ * til_write_patch() copies the subtrees without one as they are.
+ */
+static void record_edit(til_state_t* state, const til_value_t* container)
+{
+    const int* edited = (const int*)state->edited.data;
+    int        start  = container->span.start;
+    int        count  = state->edited.count / (int)sizeof(int);
+
+    state->edits++;
+    if (start >= 0 && (count == 0 || edited[count - 1] != start)
+        && !buffer_push(&state->edited, &start, sizeof(int)))
+    {
+        state->edited_lost = TIL_TRUE;
+    }
+}
+
+/* A container can be mutated when it is not shared, when no til_overlay()
+ * result shares the state and, in a til_overlay() result, when it lives in
+ * the storage of the result rather than of a layer.
+ */
+static til_bool_t is_mutable(til_state_t* state, const til_value_t* container, til_type_t type)
+{
+    if (!state || !container || container->type != type || (container->flags & TIL_FLAG_SHARED))
+    {
+        return TIL_FALSE;
+    }
+    else if (til_atomic_add(&state->layered, 0) > 0)
+    {
+        return TIL_FALSE;
+    }
+    else if (!state->layers[0] && !state->layers[1])
+    {
+        return TIL_TRUE;
+    }
+
+    const til_block_t* block;
+    for (block = state->blocks; block; block = block->next)
+    {
+        const char* start = (const char*)block + TIL_BLOCK_HEADER;
+        if ((const char*)container >= start && (const char*)container < start + block->used)
+        {
+            return TIL_TRUE;
+        }
+    }
+    return TIL_FALSE;
+}
+
+/* @funcdef: til_table_get */
+til_value_t* til_table_get(const til_value_t* table, const char* name)
+{
+    if (table && table->type == TIL_TABLE && name)
+    {
+        int i, n;
+        int length = (int)strlen(name);
+        for (i = 0, n = table->table.length; i < n; i++)
+        {
+            til_cell_t* cell = &table->table.values[i];
+            if (cell->name.string.length == length && memcmp(cell->name.string.buffer, name, length) == 0)
+            {
+                return &cell->value;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* @funcdef: til_table_set */
+til_value_t* til_table_set(til_state_t* state, til_value_t* table, const char* name, const til_value_t* value)
+{
+    if (!is_mutable(state, table, TIL_TABLE) || !name || !value)
+    {
+        return NULL;
+    }
+
+    til_value_t* slot = til_table_get(table, name);
+    if (slot)
+    {
+        slot = replace_value(state, slot, value);
+        if (slot)
+        {
+            record_edit(state, table);
+        }
+        return slot;
+    }
+
+    til_cell_t cell;
+    make_value(&cell.name, TIL_STRING);
+    cell.name.string.length = (int)strlen(name);
+    cell.name.string.buffer = make_string(state, name, cell.name.string.length);
+    if (!cell.name.string.buffer || !copy_value(state, &cell.value, value))
+    {
+        return NULL;
+    }
+    cell.value.flags |= TIL_FLAG_MODIFIED;
+
+    int          length = table->table.length;
+    til_cell_t*  cells  = (til_cell_t*)grow_storage(state, table, table->table.values, length, sizeof(til_cell_t));
+    if (!cells)
+    {
+        return NULL;
+    }
+
+    cells[length] = cell;
+
+    table->table.values = cells;
+    table->table.length = length + 1;
+    record_edit(state, table);
+    return &cells[length].value;
+}
+
+/* @funcdef: til_table_remove */
+til_bool_t til_table_remove(til_state_t* state, til_value_t* table, const char* name)
+{
+    til_value_t* slot = is_mutable(state, table, TIL_TABLE) ? til_table_get(table, name) : NULL;
+    if (!slot)
+    {
+        return TIL_FALSE;
+    }
+
+    til_cell_t* cell  = (til_cell_t*)((char*)slot - offsetof(til_cell_t, value));
+    int         index = (int)(cell - table->table.values);
+    memmove(cell, cell + 1, (table->table.length - index - 1) * sizeof(til_cell_t));
+
+    table->table.length--;
+    record_edit(state, table);
+    return TIL_TRUE;
+}
+
+/* @funcdef: til_array_set */
+til_value_t* til_array_set(til_state_t* state, til_value_t* array, int index, const til_value_t* value)
+{
+    if (!is_mutable(state, array, TIL_ARRAY) || !value
+        || index < 0 || index >= array->array.length)
+    {
+        return NULL;
+    }
+
+    if (array->array.kind == TIL_ARRAY_NUMBERS)
+    {
+        if (value->type == TIL_NUMBER)
+        {
+            array->array.numbers[index] = value->number;
+            array->flags |= TIL_FLAG_MODIFIED;
+            record_edit(state, array);
+            return array;
+        }
+        else if (!unpack_array(state, array))
+        {
+            return NULL;
+        }
+    }
+
+    til_value_t* slot = replace_value(state, &array->array.values[index], value);
+    if (slot)
+    {
+        record_edit(state, array);
+    }
+    return slot;
+}
+
+/* @funcdef: til_array_insert */
+til_value_t* til_array_insert(til_state_t* state, til_value_t* array, int index, const til_value_t* value)
+{
+    if (!is_mutable(state, array, TIL_ARRAY) || !value
+        || index < 0 || index > array->array.length)
+    {
+        return NULL;
+    }
+
+    int length = array->array.length;
+    if (array->array.kind == TIL_ARRAY_NUMBERS)
+    {
+        if (value->type == TIL_NUMBER)
+        {
+            double* numbers = (double*)grow_storage(state, array, array->array.numbers, length, sizeof(double));
+            if (!numbers)
+            {
+                return NULL;
+            }
+
+            memmove(numbers + index + 1, numbers + index, (length - index) * sizeof(double));
+            numbers[index] = value->number;
+
+            array->array.numbers = numbers;
+            array->array.length  = length + 1;
+            array->flags        |= TIL_FLAG_MODIFIED;
+            record_edit(state, array);
+            return array;
+        }
+        else if (!unpack_array(state, array))
+        {
+            return NULL;
+        }
+    }
+
+    til_value_t item;
+    if (!copy_value(state, &item, value))
+    {
+        return NULL;
+    }
+    item.flags |= TIL_FLAG_MODIFIED;
+
+    til_value_t* values = (til_value_t*)grow_storage(state, array, array->array.values, length, sizeof(til_value_t));
+    if (!values)
+    {
+        return NULL;
+    }
+
+    memmove(values + index + 1, values + index, (length - index) * sizeof(til_value_t));
+    values[index] = item;
+
+    array->array.values = values;
+    array->array.length = length + 1;
+    record_edit(state, array);
+    return &values[index];
+}
+
+/* @funcdef: til_array_remove */
+til_bool_t til_array_remove(til_state_t* state, til_value_t* array, int index)
+{
+    if (!is_mutable(state, array, TIL_ARRAY)
+        || index < 0 || index >= array->array.length)
+    {
+        return TIL_FALSE;
+    }
+
+    int count = array->array.length - index - 1;
+    if (array->array.kind == TIL_ARRAY_NUMBERS)
+    {
+        memmove(array->array.numbers + index, array->array.numbers + index + 1, count * sizeof(double));
+        array->flags |= TIL_FLAG_MODIFIED;
+    }
+    else
+    {
+        memmove(array->array.values + index, array->array.values + index + 1, count * sizeof(til_value_t));
+    }
+
+    array->array.length--;
+    record_edit(state, array);
+    return TIL_TRUE;
+}
+
+/*
+ * Overlays
+ */
+
+/* Copy of a value whose storage stays in its state, an empty container
+ * that is set into grows into new storage.
+ */
+static til_value_t* share_value(til_value_t* dst, const til_value_t* src)
+{
+    *dst = *src;
+    dst->span.start = -1;
+    dst->span.end   = -1;
+    dst->flags     &= ~TIL_FLAG_RESIZABLE;
+
+    if ((src->type == TIL_TABLE && src->table.length > 0) || (src->type == TIL_ARRAY && src->array.length > 0))
+    {
+        dst->flags |= TIL_FLAG_SHARED;
+    }
+    return dst;
+}
+
+static til_value_t* append_array(til_state_t* state, til_value_t* dst, const til_value_t* base, const til_value_t* patch)
+{
+    int base_length = base->array.length;
+    int length      = base_length + patch->array.length;
+
+    if (base_length == 0 || base_length == length)
+    {
+        return share_value(dst, base_length == 0 ? patch : base);
+    }
+
+    til_value_t array;
+    make_value(&array, TIL_ARRAY);
+    array.array.length = length;
+
+    int i;
+    if (base->array.kind == TIL_ARRAY_NUMBERS && patch->array.kind == TIL_ARRAY_NUMBERS)
+    {
+        double* numbers = (double*)arena_alloc(state, length * sizeof(double));
+        if (!numbers)
+        {
+            return NULL;
+        }
+
+        memcpy(numbers, base->array.numbers, base_length * sizeof(double));
+        memcpy(numbers + base_length, patch->array.numbers, (length - base_length) * sizeof(double));
+
+        array.array.kind    = TIL_ARRAY_NUMBERS;
+        array.array.numbers = numbers;
+    }
+    else
+    {
+        til_value_t* values = (til_value_t*)arena_alloc(state, length * sizeof(til_value_t));
+        if (!values)
+        {
+            return NULL;
+        }
+
+        for (i = 0; i < length; i++)
+        {
+            til_value_t item = i < base_length ? til_array_get(base, i) : til_array_get(patch, i - base_length);
+            share_value(&values[i], &item);
+        }
+
+        array.array.values = values;
+    }
+
+    *dst = array;
+    return dst;
+}
+
+static til_value_t* merge_value(til_state_t* state, til_value_t* dst, const til_value_t* base, const til_value_t* patch, int flags);
+
+/* Copies the cells of base, then merges, adds or removes the cells of patch */
+static til_value_t* merge_table(til_state_t* state, til_value_t* dst, const til_value_t* base, const til_value_t* patch, int flags)
+{
+    int capacity = base->table.length + patch->table.length;
+    int length   = base->table.length;
+
+    til_cell_t* cells = capacity > 0 ? (til_cell_t*)arena_alloc(state, capacity * sizeof(til_cell_t)) : NULL;
+    if (capacity > 0 && !cells)
+    {
+        return NULL;
+    }
+
+    int i, j;
+    for (i = 0; i < length; i++)
+    {
+        share_value(&cells[i].name, &base->table.values[i].name);
+        share_value(&cells[i].value, &base->table.values[i].value);
+    }
+
+    for (i = 0; i < patch->table.length; i++)
+    {
+        const til_cell_t* cell = &patch->table.values[i];
+
+        for (j = 0; j < length; j++)
+        {
+            if (cells[j].name.string.length == cell->name.string.length
+                && memcmp(cells[j].name.string.buffer, cell->name.string.buffer, cell->name.string.length) == 0)
+            {
+                break;
+            }
+        }
+
+        if (cell->value.type == TIL_NIL && (flags & TIL_MERGE_NIL_DELETES))
+        {
+            if (j < length)
+            {
+                memmove(&cells[j], &cells[j + 1], (length - j - 1) * sizeof(til_cell_t));
+                length--;
+            }
+        }
+        else if (j < length)
+        {
+            til_value_t merged;
+            if (!merge_value(state, &merged, &cells[j].value, &cell->value, flags))
+            {
+                return NULL;
+            }
+            cells[j].value = merged;
+        }
+        else
+        {
+            share_value(&cells[length].name, &cell->name);
+            share_value(&cells[length].value, &cell->value);
+            length++;
+        }
+    }
+
+    make_value(dst, TIL_TABLE);
+    dst->table.length = length;
+    dst->table.values = length > 0 ? cells : NULL;
+    return dst;
+}
+
+static til_value_t* merge_value(til_state_t* state, til_value_t* dst, const til_value_t* base, const til_value_t* patch, int flags)
+{
+    if (base->type == TIL_TABLE && patch->type == TIL_TABLE)
+    {
+        return merge_table(state, dst, base, patch, flags);
+    }
+    else if (base->type == TIL_ARRAY && patch->type == TIL_ARRAY && (flags & TIL_MERGE_APPEND_ARRAYS))
+    {
+        return append_array(state, dst, base, patch);
+    }
+    else
+    {
+        return share_value(dst, patch);
+    }
+}
+
+/* @funcdef: til_overlay */
+til_value_t* til_overlay(til_state_t* base, til_state_t* patch, int flags, til_state_t** out_state)
+{
+    if (out_state)
+    {
+        *out_state = NULL;
+    }
+
+    if (!base || !patch || !base->root || !patch->root)
+    {
+        return NULL;
+    }
+
+    til_state_t* state = make_state("");
+    if (!state)
+    {
+        return NULL;
+    }
+
+    state->layers[0] = til_retain(base);
+    state->layers[1] = til_retain(patch);
+    til_atomic_add(&base->layered, 1);
+    til_atomic_add(&patch->layered, 1);
+
+    /* Nothing comes from source code, til_write_patch() re-serializes it all */
+    state->edits = 1;
+
+    til_value_t* value = (til_value_t*)arena_alloc(state, sizeof(til_value_t));
+    if (!value || !merge_value(state, value, base->root, patch->root, flags))
+    {
+        til_release(state);
+        return NULL;
+    }
+
+    state->root = value;
+
+    if (out_state)
+    {
+        *out_state = state;
+    }
+    else
+    {
+        state->next = root_state;
+        root_state  = state;
+    }
+    return value;
+}
+
+/*
+ * Format-preserving writer
+ */
+
+typedef struct til_patch_t
+{
+    const char* buffer;
+    int         length;
+    FILE*       out;
+
+    /* Source bytes waiting to be written, adjacent copies are merged */
+    int         start;
+    int         end;
+
+    /* Sorted span starts of the edited containers, NULL to walk everything */
+    const int*  edited;
+    int         edited_count;
+} til_patch_t;
+
+static void patch_flush(til_patch_t* patch)
+{
+    if (patch->end > patch->start)
+    {
+        fwrite(patch->buffer + patch->start, 1, patch->end - patch->start, patch->out);
+    }
+    patch->start = patch->end = 0;
+}
+
+static void patch_copy(til_patch_t* patch, int start, int end)
+{
+    if (start >= end)
+    {
+        return;
+    }
+    else if (start == patch->end && patch->end > patch->start)
+    {
+        patch->end = end;
+    }
+    else
+    {
+        patch_flush(patch);
+        patch->start = start;
+        patch->end   = end;
+    }
+}
+
+static void patch_text(til_patch_t* patch, const char* text, int length)
+{
+    patch_flush(patch);
+    fwrite(text, 1, length, patch->out);
+}
+
+static void write_name(const til_value_t* name, FILE* out)
+{
+    if (is_symbol(name->string.buffer, name->string.length))
+    {
+        fwrite(name->string.buffer, 1, name->string.length, out);
+    }
+    else
+    {
+        fprintf(out, "[\"%s\"]", name->string.buffer);
+    }
+}
+
+/* Compact TIL code of a value, used for everything that has no source */
+static void write_code(const til_value_t* value, FILE* out)
+{
+    char number[400];
+    int  i, n;
+
+    switch (value->type)
+    {
+    case TIL_NIL:
+        fprintf(out, "nil");
+        break;
+
+    case TIL_NUMBER:
+        fwrite(number, 1, format_code_number(number, value->number), out);
+        break;
+
+    case TIL_BOOLEAN:
+        fprintf(out, "%s", value->boolean ? "true" : "false");
+        break;
+
+    case TIL_STRING:
+        fprintf(out, "\"%s\"", value->string.buffer);
+        break;
+
+    case TIL_ARRAY:
+        fprintf(out, "[");
+        for (i = 0, n = value->array.length; i < n; i++)
+        {
+            if (i > 0)
+            {
+                fprintf(out, ", ");
+            }
+
+            if (value->array.kind == TIL_ARRAY_NUMBERS)
+            {
+                fwrite(number, 1, format_code_number(number, value->array.numbers[i]), out);
+            }
+            else
+            {
+                write_code(&value->array.values[i], out);
+            }
+        }
+        fprintf(out, "]");
+        break;
+
+    case TIL_TABLE:
+        fprintf(out, "{");
+        for (i = 0, n = value->table.length; i < n; i++)
+        {
+            fprintf(out, " ");
+            write_name(&value->table.values[i].name, out);
+            fprintf(out, " = ");
+            write_code(&value->table.values[i].value, out);
+            fprintf(out, ";");
+        }
+        fprintf(out, n > 0 ? " }" : "}");
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Whitespace right before the closing bracket at close, when the text that
+ * followed the last written element cannot be reused.
+ */
+static int closing_trivia(til_patch_t* patch, int open, int close)
+{
+    while (close > open + 1 && isspace((unsigned char)patch->buffer[close - 1]))
+    {
+        close--;
+    }
+    return close;
+}
+
+/* Whether a container edited since parsing starts within [start, end) */
+static til_bool_t patch_has_edit(const til_patch_t* patch, int start, int end)
+{
+    if (!patch->edited)
+    {
+        return TIL_TRUE;
+    }
+
+    int low  = 0;
+    int high = patch->edited_count;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (patch->edited[middle] < start)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low < patch->edited_count && patch->edited[low] < end ? TIL_TRUE : TIL_FALSE;
+}
+
+static void patch_value(til_patch_t* patch, const til_value_t* value);
+
+static void patch_table(til_patch_t* patch, const til_value_t* table)
+{
+    const char* buffer = patch->buffer;
+    int         open   = scan_trivia(buffer, table->span.start, patch->length);
+    int         close  = table->span.end - 1;
+    int         last   = -1;    /* end of the last parsed cell written */
+
+    /* New cells are put on their own line, indented like the first parsed one */
+    const char* indent        = " ";
+    int         indent_length = 1;
+
+    int i, n;
+    for (i = 0, n = table->table.length; i < n; i++)
+    {
+        const til_value_t* name = &table->table.values[i].name;
+        if (name->span.start >= 0)
+        {
+            int token = scan_trivia(buffer, name->span.start, name->span.end);
+            int line  = token;
+            while (line > name->span.start && buffer[line - 1] != '\n')
+            {
+                line--;
+            }
+
+            if (line > name->span.start)
+            {
+                indent        = buffer + line - 1;
+                indent_length = token - line + 1;
+            }
+            break;
+        }
+    }
+
+    patch_copy(patch, table->span.start, open + 1);
+    for (i = 0, n = table->table.length; i < n; i++)
+    {
+        const til_cell_t* cell = &table->table.values[i];
+        if (cell->name.span.start >= 0)
+        {
+            int separator = scan_trivia(buffer, cell->value.span.end, close);
+
+            patch_copy(patch, cell->name.span.start, cell->value.span.start);
+            patch_value(patch, &cell->value);
+            patch_copy(patch, cell->value.span.end, separator + 1);
+
+            last = separator + 1;
+        }
+        else
+        {
+            patch_text(patch, indent, indent_length);
+            write_name(&cell->name, patch->out);
+            fprintf(patch->out, " = ");
+            write_code(&cell->value, patch->out);
+            fprintf(patch->out, ";");
+        }
+    }
+
+    if (last >= 0 && scan_trivia(buffer, last, close) == close)
+    {
+        patch_copy(patch, last, table->span.end);
+    }
+    else
+    {
+        patch_copy(patch, closing_trivia(patch, open, close), table->span.end);
+    }
+}
+
+static void patch_array(til_patch_t* patch, const til_value_t* array)
+{
+    const char* buffer = patch->buffer;
+    int         open   = scan_trivia(buffer, array->span.start, patch->length);
+    int         close  = array->span.end - 1;
+    int         last   = -1;    /* end of the last parsed element written */
+    int         prev   = -1;    /* same, only when it is the previous element */
+
+    patch_copy(patch, array->span.start, open + 1);
+
+    int i, n;
+    for (i = 0, n = array->array.length; i < n; i++)
+    {
+        const til_value_t* item = &array->array.values[i];
+        if (i > 0)
+        {
+            /* Keep the original separator when both elements were adjacent */
+            if (prev >= 0 && item->span.start > 0 && buffer[item->span.start - 1] == ','
+                && scan_trivia(buffer, prev, close) == item->span.start - 1)
+            {
+                patch_copy(patch, prev, item->span.start);
+            }
+            else if (item->span.start >= 0 && scan_trivia(buffer, item->span.start, item->span.end) > item->span.start)
+            {
+                patch_text(patch, ",", 1);
+            }
+            else
+            {
+                patch_text(patch, ", ", 2);
+            }
+        }
+
+        if (item->span.start >= 0)
+        {
+            patch_value(patch, item);
+            last = prev = item->span.end;
+        }
+        else
+        {
+            patch_flush(patch);
+            write_code(item, patch->out);
+            prev = -1;
+        }
+    }
+
+    if (last >= 0 && scan_trivia(buffer, last, close) == close)
+    {
+        patch_copy(patch, last, array->span.end);
+    }
+    else
+    {
+        patch_copy(patch, closing_trivia(patch, open, close), array->span.end);
+    }
+}
+
+static void patch_value(til_patch_t* patch, const til_value_t* value)
+{
+    if (value->span.start < 0)
+    {
+        patch_flush(patch);
+        write_code(value, patch->out);
+    }
+    else if (value->flags & TIL_FLAG_MODIFIED)
+    {
+        patch_copy(patch, value->span.start, scan_trivia(patch->buffer, value->span.start, value->span.end));
+        patch_flush(patch);
+        write_code(value, patch->out);
+    }
+    else if (value->flags & TIL_FLAG_SHARED)
+    {
+        /* Children of shared storage carry the spans of its first occurrence */
+        patch_copy(patch, value->span.start, value->span.end);
+    }
+    else if (!patch_has_edit(patch, value->span.start, value->span.end))
+    {
+        patch_copy(patch, value->span.start, value->span.end);
+    }
+    else if (value->type == TIL_TABLE)
+    {
+        patch_table(patch, value);
+    }
+    else if (value->type == TIL_ARRAY && value->array.kind == TIL_ARRAY_VALUES)
+    {
+        patch_array(patch, value);
+    }
+    else
+    {
+        patch_copy(patch, value->span.start, value->span.end);
+    }
+}
+
+static int compare_ints(const void* a, const void* b)
+{
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+/* @funcdef: til_write_patch */
+void til_write_patch(const til_state_t* state, const til_value_t* value, FILE* out)
+{
+    if (!state || !value)
+    {
+        return;
+    }
+
+    if (state->edits == 0)
+    {
+        fwrite(state->buffer, 1, state->length, out);
+        return;
+    }
+
+    til_patch_t patch;
+    patch.buffer = state->buffer;
+    patch.length = state->length;
+    patch.out    = out;
+    patch.start  = 0;
+    patch.end    = 0;
+
+    /* Without the edit positions every container is walked */
+    int  count  = state->edited_lost ? 0 : state->edited.count / (int)sizeof(int);
+    int* edited = count > 0 ? (int*)malloc(count * sizeof(int)) : NULL;
+    if (edited)
+    {
+        memcpy(edited, state->edited.data, count * sizeof(int));
+        qsort(edited, count, sizeof(int), compare_ints);
+    }
+    patch.edited       = edited;
+    patch.edited_count = count;
+
+    patch_value(&patch, value);
+
+    /* Trailing trivia of the source, a value without a span (an overlay) has none */
+    if (value->span.end >= 0)
+    {
+        patch_copy(&patch, value->span.end, state->length);
+    }
+    patch_flush(&patch);
+    free(edited);
+}
+
+/*
+ * Binary images
+ */
+
+#define TIL_IMAGE_VERSION 1
+
+/* The image is native-endian, a foreign byte order fails the version check */
+typedef struct til_image_header_t
+{
+    char               magic[4];    /* "TILB" */
+    unsigned int       version;
+    unsigned long long size;        /* bytes of the whole image */
+    unsigned long long checksum;    /* of this header, computed with checksum = 0 */
+    til_node_t         root;
+} til_image_header_t;
+
+struct til_image_t
+{
+    const char* data;
+    size_t      size;
+};
+
+static unsigned long long image_checksum(const til_image_header_t* header)
+{
+    til_image_header_t copy = *header;
+    copy.checksum = 0;
+
+    unsigned long long   hash  = 14695981039346656037ull;
+    const unsigned char* bytes = (const unsigned char*)&copy;
+
+    size_t i;
+    for (i = 0; i < sizeof(copy); i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Returns the offset of size zeroed bytes at the end of the image, -1 on failure */
+static int image_reserve(til_buffer_t* image, int size)
+{
+    size = (size + 7) & ~7;
+    if (image->count + size > image->capacity)
+    {
+        int capacity = image->capacity > 0 ? image->capacity * 2 : 4096;
+        while (capacity < image->count + size)
+        {
+            capacity *= 2;
+        }
+
+        char* data = (char*)realloc(image->data, capacity);
+        if (!data)
+        {
+            return -1;
+        }
+
+        image->data     = data;
+        image->capacity = capacity;
+    }
+
+    int offset = image->count;
+    memset(image->data + offset, 0, size);
+    image->count += size;
+    return offset;
+}
+
+/* Nodes are written at their offset once their children are, the data may move */
+static til_bool_t save_node(til_buffer_t* image, int at, const til_value_t* value)
+{
+    til_node_t node;
+    memset(&node, 0, sizeof(node));
+    node.type = (unsigned short)value->type;
+
+    int i, n, offset = 0;
+    switch (value->type)
+    {
+    case TIL_NUMBER:
+        node.number = value->number;
+        break;
+
+    case TIL_BOOLEAN:
+        node.boolean = value->boolean;
+        break;
+
+    case TIL_STRING:
+        n = value->string.length;
+        if ((offset = image_reserve(image, n + 1)) < 0)
+        {
+            return TIL_FALSE;
+        }
+
+        memcpy(image->data + offset, value->string.buffer, n);
+        node.length = n;
+        node.offset = offset;
+        break;
+
+    case TIL_ARRAY:
+        n = value->array.length;
+        if (value->array.kind == TIL_ARRAY_NUMBERS)
+        {
+            if ((offset = image_reserve(image, n * sizeof(double))) < 0)
+            {
+                return TIL_FALSE;
+            }
+
+            memcpy(image->data + offset, value->array.numbers, n * sizeof(double));
+        }
+        else
+        {
+            if ((offset = image_reserve(image, n * sizeof(til_node_t))) < 0)
+            {
+                return TIL_FALSE;
+            }
+
+            for (i = 0; i < n; i++)
+            {
+                if (!save_node(image, offset + i * sizeof(til_node_t), &value->array.values[i]))
+                {
+                    return TIL_FALSE;
+                }
+            }
+        }
+        node.kind   = (unsigned short)value->array.kind;
+        node.length = n;
+        node.offset = offset;
+        break;
+
+    case TIL_TABLE:
+        n = value->table.length;
+        if ((offset = image_reserve(image, n * 2 * sizeof(til_node_t))) < 0)
+        {
+            return TIL_FALSE;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            int cell = offset + i * 2 * sizeof(til_node_t);
+            if (!save_node(image, cell, &value->table.values[i].name)
+                || !save_node(image, cell + sizeof(til_node_t), &value->table.values[i].value))
+            {
+                return TIL_FALSE;
+            }
+        }
+        node.length = n;
+        node.offset = offset;
+        break;
+
+    default:
+        break;
+    }
+
+    memcpy(image->data + at, &node, sizeof(node));
+    return TIL_TRUE;
+}
+
+/* @funcdef: til_save_binary */
+til_bool_t til_save_binary(const til_value_t* value, const char* path)
+{
+    if (!value || !path)
+    {
+        return TIL_FALSE;
+    }
+
+    til_buffer_t image = { 0, 0, NULL };
+    til_bool_t   saved = TIL_FALSE;
+    if (image_reserve(&image, sizeof(til_image_header_t)) == 0
+        && save_node(&image, offsetof(til_image_header_t, root), value))
+    {
+        til_image_header_t* header = (til_image_header_t*)image.data;
+        memcpy(header->magic, "TILB", 4);
+        header->version  = TIL_IMAGE_VERSION;
+        header->size     = image.count;
+        header->checksum = image_checksum(header);
+
+        FILE* file = fopen(path, "wb");
+        if (file)
+        {
+            saved = fwrite(image.data, 1, image.count, file) == (size_t)image.count ? TIL_TRUE : TIL_FALSE;
+            saved = fclose(file) == 0 ? saved : TIL_FALSE;
+        }
+    }
+
+    free(image.data);
+    return saved;
+}
+
+/* Maps a whole file read-only, an empty file gives data = NULL and size = 0 */
+static til_bool_t map_file(const char* path, const char** out_data, size_t* out_size)
+{
+    const char* data   = NULL;
+    size_t      size   = 0;
+    til_bool_t  mapped = TIL_FALSE;
+
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return TIL_FALSE;
+    }
+
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size))
+    {
+        if (file_size.QuadPart == 0)
+        {
+            mapped = TIL_TRUE;
+        }
+        else if ((unsigned long long)file_size.QuadPart <= (size_t)-1)
+        {
+            HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping)
+            {
+                data   = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                size   = (size_t)file_size.QuadPart;
+                mapped = data != NULL;
+                CloseHandle(mapping);
+            }
+        }
+    }
+    CloseHandle(file);
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+    {
+        return TIL_FALSE;
+    }
+
+    struct stat file_stat;
+    if (fstat(file, &file_stat) == 0)
+    {
+        if (file_stat.st_size == 0)
+        {
+            mapped = TIL_TRUE;
+        }
+        else
+        {
+            void* view = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_SHARED, file, 0);
+            if (view != MAP_FAILED)
+            {
+                data   = (const char*)view;
+                size   = (size_t)file_stat.st_size;
+                mapped = TIL_TRUE;
+            }
+        }
+    }
+    close(file);
+#endif
+
+    *out_data = data;
+    *out_size = size;
+    return mapped;
+}
+
+static void unmap_file(const char* data, size_t size)
+{
+    if (!data)
+    {
+        return;
+    }
+
+#if defined(_WIN32)
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap((void*)data, size);
+#endif
+}
+
+/* @funcdef: til_load_binary */
+til_image_t* til_load_binary(const char* path)
+{
+    const char* data;
+    size_t      size;
+    if (!map_file(path, &data, &size))
+    {
+        return NULL;
+    }
+
+    if (size < sizeof(til_image_header_t))
+    {
+        unmap_file(data, size);
+        return NULL;
+    }
+
+    /* Only the header is verified, nodes are bounds-checked when accessed */
+    const til_image_header_t* header = (const til_image_header_t*)data;
+    til_image_t*              image  = NULL;
+    if (memcmp(header->magic, "TILB", 4) == 0 && header->version == TIL_IMAGE_VERSION
+        && header->size == size && header->checksum == image_checksum(header))
+    {
+        image = (til_image_t*)malloc(sizeof(til_image_t));
+    }
+
+    if (!image)
+    {
+        unmap_file(data, size);
+        return NULL;
+    }
+
+    image->data = data;
+    image->size = size;
+    return image;
+}
+
+/* @funcdef: til_unload_binary */
+void til_unload_binary(til_image_t* image)
+{
+    if (image)
+    {
+        unmap_file(image->data, image->size);
+        free(image);
+    }
+}
+
+/* Pointer to count elements of size at offset, NULL when outside the image.
+ * Nodes and numbers are written 8-aligned, a misaligned offset is corrupt.
+ */
+static const void* image_at(const til_image_t* image, unsigned long long offset, unsigned long long count, size_t size)
+{
+    if (offset > image->size || count > (image->size - offset) / size || (size >= 8 && (offset & 7) != 0))
+    {
+        return NULL;
+    }
+    return image->data + offset;
+}
+
+/* @funcdef: til_image_root */
+const til_node_t* til_image_root(const til_image_t* image)
+{
+    return image ? &((const til_image_header_t*)image->data)->root : NULL;
+}
+
+/* @funcdef: til_node_string */
+const char* til_node_string(const til_image_t* image, const til_node_t* node)
+{
+    if (!image || !node || node->type != TIL_STRING)
+    {
+        return NULL;
+    }
+
+    /* Callers use it as a C string, it must end where the node says */
+    const char* string = (const char*)image_at(image, node->offset, (unsigned long long)node->length + 1, 1);
+    return string && string[node->length] == 0 ? string : NULL;
+}
+
+/* @funcdef: til_node_numbers */
+const double* til_node_numbers(const til_image_t* image, const til_node_t* array)
+{
+    if (!image || !array || array->type != TIL_ARRAY || array->kind != TIL_ARRAY_NUMBERS)
+    {
+        return NULL;
+    }
+    return (const double*)image_at(image, array->offset, array->length, sizeof(double));
+}
+
+/* @funcdef: til_node_at */
+const til_node_t* til_node_at(const til_image_t* image, const til_node_t* array, int index)
+{
+    if (!image || !array || array->type != TIL_ARRAY || array->kind != TIL_ARRAY_VALUES
+        || index < 0 || (unsigned)index >= array->length)
+    {
+        return NULL;
+    }
+
+    const til_node_t* nodes = (const til_node_t*)image_at(image, array->offset, array->length, sizeof(til_node_t));
+    return nodes ? &nodes[index] : NULL;
+}
+
+/* @funcdef: til_node_name */
+const til_node_t* til_node_name(const til_image_t* image, const til_node_t* table, int index)
+{
+    if (!image || !table || table->type != TIL_TABLE || index < 0 || (unsigned)index >= table->length)
+    {
+        return NULL;
+    }
+
+    const til_node_t* nodes = (const til_node_t*)image_at(image, table->offset, table->length * 2ull, sizeof(til_node_t));
+    return nodes ? &nodes[index * 2] : NULL;
+}
+
+/* @funcdef: til_node_value */
+const til_node_t* til_node_value(const til_image_t* image, const til_node_t* table, int index)
+{
+    const til_node_t* name = til_node_name(image, table, index);
+    return name ? name + 1 : NULL;
+}
+
+/* @funcdef: til_node_get */
+const til_node_t* til_node_get(const til_image_t* image, const til_node_t* table, const char* name)
+{
+    if (!image || !table || table->type != TIL_TABLE || !name)
+    {
+        return NULL;
+    }
+
+    const til_node_t* nodes = (const til_node_t*)image_at(image, table->offset, table->length * 2ull, sizeof(til_node_t));
+    if (!nodes)
+    {
+        return NULL;
+    }
+
+    size_t   length = strlen(name);
+    unsigned i;
+    for (i = 0; i < table->length; i++)
+    {
+        const til_node_t* key = &nodes[i * 2];
+        if (key->length == length)
+        {
+            const char* string = til_node_string(image, key);
+            if (string && memcmp(string, name, length) == 0)
+            {
+                return key + 1;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Record streams
+ */
+
+#ifndef TIL_STREAM_BATCH_SIZE
+#define TIL_STREAM_BATCH_SIZE (1024 * 1024)
+#endif
+
+#if defined(TIL_NO_THREADS)
+typedef int til_mutex_t;
+typedef int til_cond_t;
+typedef int til_thread_t;
+#elif defined(_WIN32)
+typedef CRITICAL_SECTION   til_mutex_t;
+typedef CONDITION_VARIABLE til_cond_t;
+typedef HANDLE             til_thread_t;
+#else
+typedef pthread_mutex_t    til_mutex_t;
+typedef pthread_cond_t     til_cond_t;
+typedef pthread_t          til_thread_t;
+#endif
+
+typedef enum
+{
+    TIL_SLOT_EMPTY,
+    TIL_SLOT_QUEUED,
+    TIL_SLOT_PARSING,
+    TIL_SLOT_DONE,
+} til_slot_status_t;
+
+/* A batch and the state its records live in */
+typedef struct til_slot_t
+{
+    int          status;    /* til_slot_status_t */
+    size_t       start;     /* source range of the batch */
+    size_t       end;
+    til_state_t* state;
+    int          count;
+    til_value_t* records;
+    long long    error;     /* offset where parsing failed, -1 if none */
+} til_slot_t;
+
+struct til_stream_t
+{
+    const char*   data;
+    size_t        size;
+    til_bool_t    mapped;
+    size_t        cursor;       /* start of the next batch */
+
+    til_options_t options;
+    int           batch_size;
+    long long     error;
+
+    /* Ring of batches, queued at tail and delivered from head */
+    int           slot_count;
+    int           head;
+    int           tail;
+    til_bool_t    delivered;    /* the head slot is held by the caller */
+    til_slot_t*   slots;
+
+    /* Parallel mode: workers take queued slots in order */
+    int           thread_count;
+    til_bool_t    closing;
+    til_thread_t* threads;
+    til_mutex_t   mutex;
+    til_cond_t    queued;
+    til_cond_t    parsed;
+};
+
+static void stream_lock(til_stream_t* stream)
+{
+#if defined(TIL_NO_THREADS)
+    (void)stream;
+#elif defined(_WIN32)
+    if (stream->threads)
+    {
+        EnterCriticalSection(&stream->mutex);
+    }
+#else
+    if (stream->threads)
+    {
+        pthread_mutex_lock(&stream->mutex);
+    }
+#endif
+}
+
+static void stream_unlock(til_stream_t* stream)
+{
+#if defined(TIL_NO_THREADS)
+    (void)stream;
+#elif defined(_WIN32)
+    if (stream->threads)
+    {
+        LeaveCriticalSection(&stream->mutex);
+    }
+#else
+    if (stream->threads)
+    {
+        pthread_mutex_unlock(&stream->mutex);
+    }
+#endif
+}
+
+static void stream_wait(til_stream_t* stream, til_cond_t* cond)
+{
+#if defined(TIL_NO_THREADS)
+    (void)stream;
+    (void)cond;
+#elif defined(_WIN32)
+    SleepConditionVariableCS(cond, &stream->mutex, INFINITE);
+#else
+    pthread_cond_wait(cond, &stream->mutex);
+#endif
+}
+
+static void stream_wake(til_cond_t* cond)
+{
+#if defined(TIL_NO_THREADS)
+    (void)cond;
+#elif defined(_WIN32)
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+/* End of the first record that finishes batch_size bytes or more after start,
+ * skipping strings and comments. Malformed input is left to the parser.
+ */
+static size_t scan_batch(const char* data, size_t size, size_t start, size_t batch_size)
+{
+    size_t limit  = size - start > batch_size ? start + batch_size : size;
+    size_t cursor = start;
+    int    depth  = 0;
+
+    while (cursor < size)
+    {
+        /* '[' and ']' are '{' and '}' without bit 0x20 */
+        int c = data[cursor];
+        if (!((c | 0x20) == '{' || (c | 0x20) == '}' || c == '"' || c == '-'))
+        {
+            cursor++;
+            continue;
+        }
+
+        const char* found;
+        switch (c)
+        {
+        case '"':
+            found = (const char*)memchr(data + cursor + 1, '"', size - cursor - 1);
+            if (!found)
+            {
+                return size;
+            }
+            cursor = found - data + 1;
+            continue;
+
+        case '-':
+            if (cursor + 1 < size && data[cursor + 1] == '-')
+            {
+                found = (const char*)memchr(data + cursor, '\n', size - cursor);
+                if (!found)
+                {
+                    return size;
+                }
+                cursor = found - data + 1;
+                continue;
+            }
+            break;
+
+        case '{':
+        case '[':
+            depth++;
+            break;
+
+        case '}':
+        case ']':
+            if (--depth <= 0)
+            {
+                depth = 0;
+                if (cursor + 1 >= limit)
+                {
+                    return cursor + 1;
+                }
+            }
+            break;
+        }
+        cursor++;
+    }
+    return size;
+}
+
+/* Parses the records of a slot, stopping at the first record that starts
+ * limit bytes or more after the start of the slot. The records parsed before
+ * an error are kept.
+ */
+static void parse_batch(til_stream_t* stream, til_slot_t* slot, int length, int limit)
+{
+    til_state_t* state = slot->state;
+    reset_state(state, stream->data + slot->start, length);
+
+    state->hashcons  = (stream->options.flags & TIL_PARSE_HASHCONS) != 0;
+    state->max_depth = stream->options.max_depth > 0 ? stream->options.max_depth : TIL_MAX_DEPTH;
+
+    slot->count   = 0;
+    slot->records = NULL;
+    slot->error   = -1;
+
+    while (state->cursor < limit)
+    {
+        til_value_t record;
+        int         lead = state->cursor;
+
+        int c = skip_space_and_comment(state);
+        if (c <= 0)
+        {
+            break;
+        }
+
+        state->depth = 1;
+        if (c != '{' || !((stream->options.flags & TIL_PARSE_RECURSIVE) ? parse_table(state, &record) : parse_iterative(state, &record)))
+        {
+            /* A record cut by the end of a window that stops before the end of the stream, resume at it */
+            if (limit < length && slot->start + length < stream->size && slot->count > 0)
+            {
+                state->cursor = lead;
+            }
+            else
+            {
+                slot->error = (long long)(slot->start + state->cursor);
+            }
+
+            state->frames.count  = 0;
+            state->scratch.count = slot->count * sizeof(til_value_t);
+            break;
+        }
+
+        record.span.start = lead;
+        record.span.end   = state->cursor;
+        if (!scratch_push(state, &record, sizeof(record)))
+        {
+            slot->error = (long long)(slot->start + lead);
+            break;
+        }
+        slot->count++;
+    }
+
+    if (slot->count > 0)
+    {
+        slot->records = (til_value_t*)arena_alloc(state, slot->count * sizeof(til_value_t));
+        if (slot->records)
+        {
+            memcpy(slot->records, state->scratch.data, slot->count * sizeof(til_value_t));
+        }
+        else
+        {
+            slot->count = 0;
+            slot->error = (long long)slot->start;
+        }
+    }
+
+    state->scratch.count = 0;
+    slot->end            = slot->start + state->cursor;
+    free_interned(state);
+}
+
+/* Size of the next window of the stream, a state indexes its buffer with int */
+static int window_size(const til_stream_t* stream)
+{
+    size_t remain = stream->size - stream->cursor;
+    return remain < (size_t)0x7fffffff ? (int)remain : 0x7fffffff;
+}
+
+#if !defined(TIL_NO_THREADS)
+static void stream_work(til_stream_t* stream)
+{
+    stream_lock(stream);
+    for (;;)
+    {
+        til_slot_t* slot = NULL;
+
+        int i;
+        for (i = 0; i < stream->slot_count && !slot; i++)
+        {
+            til_slot_t* candidate = &stream->slots[(stream->head + i) % stream->slot_count];
+            if (candidate->status == TIL_SLOT_QUEUED)
+            {
+                slot = candidate;
+            }
+        }
+
+        if (!slot)
+        {
+            if (stream->closing)
+            {
+                break;
+            }
+            stream_wait(stream, &stream->queued);
+            continue;
+        }
+
+        slot->status = TIL_SLOT_PARSING;
+        stream_unlock(stream);
+
+        int length = (int)(slot->end - slot->start);
+        parse_batch(stream, slot, length, length);
+
+        stream_lock(stream);
+        slot->status = TIL_SLOT_DONE;
+        stream_wake(&stream->parsed);
+    }
+    stream_unlock(stream);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI stream_thread(LPVOID stream)
+{
+    stream_work((til_stream_t*)stream);
+    return 0;
+}
+#else
+static void* stream_thread(void* stream)
+{
+    stream_work((til_stream_t*)stream);
+    return NULL;
+}
+#endif
+#endif
+
+static void stop_threads(til_stream_t* stream)
+{
+#if !defined(TIL_NO_THREADS)
+    if (stream->threads)
+    {
+        stream_lock(stream);
+        stream->closing = TIL_TRUE;
+        stream_wake(&stream->queued);
+        stream_unlock(stream);
+
+        int i;
+        for (i = 0; i < stream->thread_count; i++)
+        {
+#if defined(_WIN32)
+            WaitForSingleObject(stream->threads[i], INFINITE);
+            CloseHandle(stream->threads[i]);
+#else
+            pthread_join(stream->threads[i], NULL);
+#endif
+        }
+
+#if defined(_WIN32)
+        DeleteCriticalSection(&stream->mutex);
+#else
+        pthread_mutex_destroy(&stream->mutex);
+        pthread_cond_destroy(&stream->queued);
+        pthread_cond_destroy(&stream->parsed);
+#endif
+        stream->thread_count = 0;
+    }
+#endif
+
+    free(stream->threads);
+    stream->threads = NULL;
+}
+
+static void start_threads(til_stream_t* stream, int count)
+{
+#if defined(TIL_NO_THREADS)
+    (void)stream;
+    (void)count;
+#else
+    stream->threads = (til_thread_t*)malloc(count * sizeof(til_thread_t));
+    if (!stream->threads)
+    {
+        return;
+    }
+
+#if defined(_WIN32)
+    InitializeCriticalSection(&stream->mutex);
+    InitializeConditionVariable(&stream->queued);
+    InitializeConditionVariable(&stream->parsed);
+#else
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->queued, NULL);
+    pthread_cond_init(&stream->parsed, NULL);
+#endif
+
+    int started;
+    for (started = 0; started < count; started++)
+    {
+#if defined(_WIN32)
+        stream->threads[started] = CreateThread(NULL, 0, stream_thread, stream, 0, NULL);
+        if (!stream->threads[started])
+        {
+            break;
+        }
+#else
+        if (pthread_create(&stream->threads[started], NULL, stream_thread, stream) != 0)
+        {
+            break;
+        }
+#endif
+    }
+
+    /* Parse in til_stream_next when no thread could start */
+    stream->thread_count = started;
+    if (started == 0)
+    {
+        stop_threads(stream);
+    }
+#endif
+}
+
+static til_stream_t* make_stream(const char* data, size_t size, til_bool_t mapped, const til_stream_options_t* options)
+{
+    til_stream_t* stream = (til_stream_t*)calloc(1, sizeof(til_stream_t));
+    if (!stream)
+    {
+        return NULL;
+    }
+
+    stream->data       = data;
+    stream->size       = size;
+    stream->mapped     = mapped;
+    stream->error      = -1;
+    stream->batch_size = options && options->batch_size > 0 ? options->batch_size : TIL_STREAM_BATCH_SIZE;
+    if (options)
+    {
+        stream->options = options->parse;
+    }
+
+    /* Twice as many batches as threads, the caller consumes some while the others are parsed */
+    int threads = options && options->threads > 1 ? options->threads : 0;
+    stream->slot_count = threads > 0 ? threads * 2 : 1;
+    stream->slots      = (til_slot_t*)calloc(stream->slot_count, sizeof(til_slot_t));
+
+    int i;
+    for (i = 0; stream->slots && i < stream->slot_count; i++)
+    {
+        stream->slots[i].state = make_state("");
+        if (!stream->slots[i].state)
+        {
+            break;
+        }
+    }
+
+    if (!stream->slots || i < stream->slot_count)
+    {
+        stream->mapped = TIL_FALSE;
+        til_stream_close(stream);
+        return NULL;
+    }
+
+    if (threads > 0)
+    {
+        start_threads(stream, threads);
+    }
+    return stream;
+}
+
+/* @funcdef: til_stream_open */
+til_stream_t* til_stream_open(const char* path, const til_stream_options_t* options)
+{
+    const char* data;
+    size_t      size;
+    if (!path || !map_file(path, &data, &size))
+    {
+        return NULL;
+    }
+
+#if !defined(_WIN32) && defined(MADV_SEQUENTIAL)
+    if (data)
+    {
+        madvise((void*)data, size, MADV_SEQUENTIAL);
+    }
+#endif
+
+    til_stream_t* stream = make_stream(data, size, TIL_TRUE, options);
+    if (!stream)
+    {
+        unmap_file(data, size);
+    }
+    return stream;
+}
+
+/* @funcdef: til_stream_buffer */
+til_stream_t* til_stream_buffer(const char* code, size_t length, const til_stream_options_t* options)
+{
+    if (!code && length > 0)
+    {
+        return NULL;
+    }
+    return make_stream(code, length, TIL_FALSE, options);
+}
+
+/* @funcdef: til_stream_next */
+til_bool_t til_stream_next(til_stream_t* stream, til_batch_t* batch)
+{
+    if (!stream || !batch)
+    {
+        return TIL_FALSE;
+    }
+
+    stream_lock(stream);
+
+    /* The batch returned by the last call is consumed */
+    if (stream->delivered)
+    {
+        stream->slots[stream->head].status = TIL_SLOT_EMPTY;
+        stream->head      = (stream->head + 1) % stream->slot_count;
+        stream->delivered = TIL_FALSE;
+    }
+
+    til_bool_t result = TIL_FALSE;
+    while (stream->error < 0)
+    {
+        /* Fill the free slots: queued for the workers, or parsed right away one at a time */
+        int queued = 0;
+        while (stream->cursor < stream->size && stream->slots[stream->tail].status == TIL_SLOT_EMPTY)
+        {
+            til_slot_t* slot = &stream->slots[stream->tail];
+            slot->start = stream->cursor;
+
+            if (stream->thread_count > 0)
+            {
+                slot->end = scan_batch(stream->data, stream->size, stream->cursor, stream->batch_size);
+                if (slot->end - slot->start > (size_t)window_size(stream))
+                {
+                    slot->end = slot->start + window_size(stream);
+                }
+                slot->status = TIL_SLOT_QUEUED;
+                queued++;
+            }
+            else
+            {
+                parse_batch(stream, slot, window_size(stream), stream->batch_size);
+                slot->status = TIL_SLOT_DONE;
+            }
+
+            stream->cursor = slot->end;
+            stream->tail   = (stream->tail + 1) % stream->slot_count;
+            if (stream->thread_count == 0)
+            {
+                break;
+            }
+        }
+
+        if (queued > 0)
+        {
+            stream_wake(&stream->queued);
+        }
+
+        /* Deliver in order */
+        til_slot_t* slot = &stream->slots[stream->head];
+        if (slot->status == TIL_SLOT_EMPTY)
+        {
+            break;
+        }
+
+        while (slot->status != TIL_SLOT_DONE)
+        {
+            stream_wait(stream, &stream->parsed);
+        }
+
+        stream->error = slot->error;
+        if (slot->count > 0)
+        {
+            batch->count   = slot->count;
+            batch->records = slot->records;
+            batch->offset  = (long long)slot->start;
+            batch->state   = slot->state;
+
+            stream->delivered = TIL_TRUE;
+            result            = TIL_TRUE;
+            break;
+        }
+
+        /* Nothing but whitespace and comments */
+        slot->status = TIL_SLOT_EMPTY;
+        stream->head = (stream->head + 1) % stream->slot_count;
+    }
+
+    stream_unlock(stream);
+    return result;
+}
+
+/* @funcdef: til_stream_error */
+long long til_stream_error(const til_stream_t* stream)
+{
+    return stream ? stream->error : -1;
+}
+
+/* @funcdef: til_stream_close */
+void til_stream_close(til_stream_t* stream)
+{
+    if (!stream)
+    {
+        return;
+    }
+
+    stop_threads(stream);
+
+    int i;
+    for (i = 0; stream->slots && i < stream->slot_count; i++)
+    {
+        free_state(stream->slots[i].state);
+    }
+    free(stream->slots);
+
+    if (stream->mapped)
+    {
+        unmap_file(stream->data, stream->size);
+    }
+    free(stream);
+}
+
+/*
+ * Snapshots
+ *
+ * Differential reference counting: current packs the index of the published
+ * version (high half) with the number of acquires since it was published (low
+ * half), so a reader acquires with a single atomic add and never touches a
+ * version that may be freed. Releases are counted down in the version, biased
+ * while it is current; the publisher moves the acquires of the replaced
+ * version there and removes the bias, whoever reaches zero frees the state.
+ */
+
+#ifndef TIL_SNAPSHOT_VERSIONS
+#define TIL_SNAPSHOT_VERSIONS 16
+#endif
+
+#define TIL_SNAPSHOT_BIAS     (1ll << 62)
+#define TIL_SNAPSHOT_TRANSFER (1ll << 31)   /* acquires moved to the version before the low half overflows */
+
+typedef struct til_version_t
+{
+    long long          busy;
+    long long          refs;
+    til_state_t*       state;
+    const til_value_t* root;
+} til_version_t;
+
+struct til_snapshot_t
+{
+    long long      current;
+    int            version_count;
+    til_version_t* versions;
+};
+
+static void retire_version(til_version_t* version)
+{
+    til_release(version->state);
+    version->state = NULL;
+    version->root  = NULL;
+    til_atomic_exchange(&version->busy, 0);
+}
+
+/* Claims a free version for state, -1 when they are all still read */
+static int claim_version(til_snapshot_t* snapshot, til_state_t* state)
+{
+    int i;
+    for (i = 0; i < snapshot->version_count; i++)
+    {
+        til_version_t* version = &snapshot->versions[i];
+        if (til_atomic_cas(&version->busy, 0, 1))
+        {
+            version->state = state;
+            version->root  = state->root;
+            version->refs  = TIL_SNAPSHOT_BIAS;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* @funcdef: til_snapshot_create */
+til_snapshot_t* til_snapshot_create(til_state_t* state, int max_versions)
+{
+    if (!state || !state->root)
+    {
+        return NULL;
+    }
+
+    til_snapshot_t* snapshot = (til_snapshot_t*)malloc(sizeof(til_snapshot_t));
+    if (!snapshot)
+    {
+        return NULL;
+    }
+
+    snapshot->version_count = max_versions > 1 ? max_versions : TIL_SNAPSHOT_VERSIONS;
+    snapshot->versions      = (til_version_t*)calloc(snapshot->version_count, sizeof(til_version_t));
+    if (!snapshot->versions)
+    {
+        free(snapshot);
+        return NULL;
+    }
+
+    snapshot->current = (long long)claim_version(snapshot, state) << 32;
+    return snapshot;
+}
+
+/* @funcdef: til_snapshot_destroy */
+void til_snapshot_destroy(til_snapshot_t* snapshot)
+{
+    if (snapshot)
+    {
+        /* No reader is left, every claimed version is released */
+        int i;
+        for (i = 0; i < snapshot->version_count; i++)
+        {
+            if (snapshot->versions[i].busy)
+            {
+                til_release(snapshot->versions[i].state);
+            }
+        }
+
+        free(snapshot->versions);
+        free(snapshot);
+    }
+}
+
+/* @funcdef: til_snapshot_publish */
+til_bool_t til_snapshot_publish(til_snapshot_t* snapshot, til_state_t* state)
+{
+    if (!snapshot || !state || !state->root)
+    {
+        return TIL_FALSE;
+    }
+
+    int index = claim_version(snapshot, state);
+    if (index < 0)
+    {
+        return TIL_FALSE;
+    }
+
+    long long      word     = til_atomic_exchange(&snapshot->current, (long long)index << 32);
+    long long      acquires = word & 0xffffffffll;
+    til_version_t* replaced = &snapshot->versions[word >> 32];
+
+    if (til_atomic_add(&replaced->refs, acquires - TIL_SNAPSHOT_BIAS) == TIL_SNAPSHOT_BIAS - acquires)
+    {
+        retire_version(replaced);
+    }
+    return TIL_TRUE;
+}
+
+/* @funcdef: til_snapshot_acquire */
+const til_value_t* til_snapshot_acquire(til_snapshot_t* snapshot, int* ticket)
+{
+    long long      word     = til_atomic_add(&snapshot->current, 1);
+    long long      acquires = (word & 0xffffffffll) + 1;
+    til_version_t* version  = &snapshot->versions[word >> 32];
+
+    /* Counted in the version before the reset in case a publish comes in
+     * between, undone when another reader acquired since (the reference held
+     * here keeps the version alive).
+     */
+    if (acquires >= TIL_SNAPSHOT_TRANSFER)
+    {
+        til_atomic_add(&version->refs, acquires);
+        if (!til_atomic_cas(&snapshot->current, word + 1, word & ~0xffffffffll))
+        {
+            til_atomic_add(&version->refs, -acquires);
+        }
+    }
+
+    *ticket = (int)(word >> 32);
+    return version->root;
+}
+
+/* @funcdef: til_snapshot_release */
+void til_snapshot_release(til_snapshot_t* snapshot, int ticket)
+{
+    til_version_t* version = &snapshot->versions[ticket];
+    if (til_atomic_add(&version->refs, -1) == 1)
+    {
+        retire_version(version);
+    }
+}
+
+/*
+ * JSON transcoders
+ */
+
+#ifndef TIL_TRANSCODE_CHUNK
+#define TIL_TRANSCODE_CHUNK (64 * 1024)
+#endif
+
+/* Room for a JSON number with an exponent, longer ones fail */
+#define TIL_NUMBER_TOKEN 512
+
+typedef struct til_transcoder_t
+{
+    FILE*        in;
+    int          cursor;
+    int          count;
+    til_bool_t   failed;
+
+    FILE*        out;
+    int          written;
+
+    til_buffer_t stack;     /* TIL_TABLE or TIL_ARRAY of each open container, as chars */
+    int          members;   /* elements of the innermost container so far */
+    til_buffer_t counts;    /* members of the outer containers */
+
+    char         input[TIL_TRANSCODE_CHUNK];
+    char         output[TIL_TRANSCODE_CHUNK];
+} til_transcoder_t;
+
+/* Makes at least need bytes available unless the input ends, returns how many are */
+static int input_fill(til_transcoder_t* t, int need)
+{
+    if (t->count - t->cursor < need && !t->failed)
+    {
+        memmove(t->input, t->input + t->cursor, t->count - t->cursor);
+        t->count -= t->cursor;
+        t->cursor = 0;
+
+        while (t->count < need)
+        {
+            size_t size = fread(t->input + t->count, 1, sizeof(t->input) - t->count, t->in);
+            if (size == 0)
+            {
+                t->failed = ferror(t->in) ? TIL_TRUE : TIL_FALSE;
+                break;
+            }
+            t->count += (int)size;
+        }
+    }
+    return t->count - t->cursor;
+}
+
+static int input_peek(til_transcoder_t* t)
+{
+    if (t->cursor == t->count && input_fill(t, 1) == 0)
+    {
+        return -1;
+    }
+    return (unsigned char)t->input[t->cursor];
+}
+
+static int input_next(til_transcoder_t* t)
+{
+    t->cursor++;
+    return input_peek(t);
+}
+
+static void output_flush(til_transcoder_t* t)
+{
+    fwrite(t->output, 1, t->written, t->out);
+    t->written = 0;
+}
+
+static void output_write(til_transcoder_t* t, const char* data, int length)
+{
+    if (t->written + length > (int)sizeof(t->output))
+    {
+        output_flush(t);
+        if (length > (int)sizeof(t->output))
+        {
+            fwrite(data, 1, length, t->out);
+            return;
+        }
+    }
+
+    memcpy(t->output + t->written, data, length);
+    t->written += length;
+}
+
+static void output_char(til_transcoder_t* t, char c)
+{
+    if (t->written == (int)sizeof(t->output))
+    {
+        output_flush(t);
+    }
+    t->output[t->written++] = c;
+}
+
+static til_bool_t push_container(til_transcoder_t* t, int type)
+{
+    char kind = (char)type;
+    if (t->stack.count >= TIL_MAX_DEPTH
+        || !buffer_push(&t->stack, &kind, 1)
+        || !buffer_push(&t->counts, &t->members, sizeof(int)))
+    {
+        return TIL_FALSE;
+    }
+
+    t->cursor++;
+    t->members = 0;
+    return TIL_TRUE;
+}
+
+/* Closes the innermost container, returns the type of the enclosing one, 0 at the root */
+static int pop_container(til_transcoder_t* t)
+{
+    t->cursor++;
+    t->stack.count  -= 1;
+    t->counts.count -= sizeof(int);
+    memcpy(&t->members, t->counts.data + t->counts.count, sizeof(int));
+    return t->stack.count > 0 ? t->stack.data[t->stack.count - 1] : 0;
+}
+
+/* A number has ended when c cannot continue any token of the charset */
+static til_bool_t is_number_end(int c, const char* charset)
+{
+    return c < 0 || !strchr(charset, c) ? TIL_TRUE : TIL_FALSE;
+}
+
+/* Matches a keyword that must not be followed by a letter or digit */
+static til_bool_t read_keyword(til_transcoder_t* t, const char* keyword, int length)
+{
+    int available = input_fill(t, length + 1);
+    if (available < length || memcmp(t->input + t->cursor, keyword, length) != 0
+        || (available > length && isalnum((unsigned char)t->input[t->cursor + length])))
+    {
+        return TIL_FALSE;
+    }
+
+    t->cursor += length;
+    return TIL_TRUE;
+}
+
+/* TIL -> JSON */
+
+static int skip_til_trivia(til_transcoder_t* t)
+{
+    int c = input_peek(t);
+    for (;;)
+    {
+        if (isspace(c))
+        {
+            c = input_next(t);
+        }
+        else if (c == '-' && input_fill(t, 2) >= 2 && t->input[t->cursor + 1] == '-')
+        {
+            while (c > 0 && c != '\n')
+            {
+                c = input_next(t);
+            }
+        }
+        else
+        {
+            return c;
+        }
+    }
+}
+
+/* Copies a TIL string as a JSON string, the cursor is on the opening quote */
+static til_bool_t til_string_to_json(til_transcoder_t* t)
+{
+    char escape[6];
+
+    t->cursor++;
+    output_char(t, '"');
+    for (;;)
+    {
+        if (input_peek(t) < 0)
+        {
+            return TIL_FALSE;
+        }
+
+        const char* data  = t->input + t->cursor;
+        int         count = t->count - t->cursor;
+        int         i;
+        for (i = 0; i < count && data[i] != '"'; i++)
+        {
+            int length = json_escape(data[i], escape);
+            if (length > 0)
+            {
+                output_write(t, data, i);
+                output_write(t, escape, length);
+
+                t->cursor += i + 1;
+                data       = t->input + t->cursor;
+                count     -= i + 1;
+                i          = -1;
+            }
+        }
+
+        output_write(t, data, i);
+        t->cursor += i;
+        if (i < count)
+        {
+            t->cursor++;
+            output_char(t, '"');
+            return TIL_TRUE;
+        }
+    }
+}
+
+/* Same grammar as parse_number (no '0' before a digit unless signed, -.5 is
+ * allowed), written in JSON form: no leading zeros, a digit before '.'.
+ * Digits are copied as they are read, so numbers can have any length.
+ */
+static til_bool_t til_number_to_json(til_transcoder_t* t)
+{
+    int        c        = input_peek(t);
+    til_bool_t negative = c == '-' ? TIL_TRUE : TIL_FALSE;
+    int        zeros    = 0;
+    int        whole    = 0;
+
+    if (negative)
+    {
+        output_char(t, '-');
+        c = input_next(t);
+    }
+
+    while (c == '0')
+    {
+        zeros++;
+        c = input_next(t);
+    }
+
+    if (!negative && (zeros > 1 || (zeros == 1 && isdigit(c))))
+    {
+        return TIL_FALSE;
+    }
+
+    while (isdigit(c))
+    {
+        output_char(t, (char)c);
+        whole++;
+        c = input_next(t);
+    }
+
+    if (whole == 0)
+    {
+        if (zeros == 0 && c != '.')
+        {
+            return TIL_FALSE;
+        }
+        output_char(t, '0');
+    }
+
+    if (c == '.')
+    {
+        output_char(t, '.');
+        c = input_next(t);
+        if (!isdigit(c))
+        {
+            return TIL_FALSE;
+        }
+
+        while (isdigit(c))
+        {
+            output_char(t, (char)c);
+            c = input_next(t);
+        }
+    }
+
+    return is_number_end(c, "-.0123456789");
+}
+
+static til_bool_t til_value_to_json(til_transcoder_t* t, int c)
+{
+    if (c == '"')
+    {
+        return til_string_to_json(t);
+    }
+    else if (c == '-' || isdigit(c))
+    {
+        return til_number_to_json(t);
+    }
+    else if (read_keyword(t, "nil", 3))
+    {
+        output_write(t, "null", 4);
+        return TIL_TRUE;
+    }
+    else if (read_keyword(t, "true", 4))
+    {
+        output_write(t, "true", 4);
+        return TIL_TRUE;
+    }
+    else if (read_keyword(t, "false", 5))
+    {
+        output_write(t, "false", 5);
+        return TIL_TRUE;
+    }
+    return TIL_FALSE;
+}
+
+/* Name of a table cell, a symbol or ["string"] */
+static til_bool_t til_name_to_json(til_transcoder_t* t, int c)
+{
+    if (isalpha(c))
+    {
+        output_char(t, '"');
+        while (isalnum(c) || c == '_')
+        {
+            output_char(t, (char)c);
+            c = input_next(t);
+        }
+        output_char(t, '"');
+        return TIL_TRUE;
+    }
+    else if (c == '[')
+    {
+        t->cursor++;
+        if (skip_til_trivia(t) != '"' || !til_string_to_json(t) || skip_til_trivia(t) != ']')
+        {
+            return TIL_FALSE;
+        }
+
+        t->cursor++;
+        return TIL_TRUE;
+    }
+    return TIL_FALSE;
+}
+
+static til_bool_t til_to_json_loop(til_transcoder_t* t)
+{
+    if (skip_til_trivia(t) != '{' || !push_container(t, TIL_TABLE))
+    {
+        return TIL_FALSE;
+    }
+    output_char(t, '{');
+
+    while (t->stack.count > 0)
+    {
+        int type = t->stack.data[t->stack.count - 1];
+        int c    = skip_til_trivia(t);
+
+        if (c == (type == TIL_TABLE ? '}' : ']'))
+        {
+            output_char(t, (char)c);
+            type = pop_container(t);
+        }
+        else
+        {
+            if (t->members > 0)
+            {
+                output_char(t, ',');
+            }
+            t->members++;
+
+            if (type == TIL_TABLE)
+            {
+                if (!til_name_to_json(t, c) || skip_til_trivia(t) != '=')
+                {
+                    return TIL_FALSE;
+                }
+
+                t->cursor++;
+                output_char(t, ':');
+            }
+            else if (t->members > 1)
+            {
+                if (c != ',')
+                {
+                    return TIL_FALSE;
+                }
+                t->cursor++;
+            }
+
+            c = skip_til_trivia(t);
+            if (c == '{' || c == '[')
+            {
+                if (!push_container(t, c == '{' ? TIL_TABLE : TIL_ARRAY))
+                {
+                    return TIL_FALSE;
+                }
+
+                output_char(t, (char)c);
+                continue;
+            }
+            else if (!til_value_to_json(t, c))
+            {
+                return TIL_FALSE;
+            }
+        }
+
+        /* A finished cell value is followed by ';' */
+        if (type == TIL_TABLE)
+        {
+            if (skip_til_trivia(t) != ';')
+            {
+                return TIL_FALSE;
+            }
+            t->cursor++;
+        }
+    }
+
+    output_char(t, '\n');
+    return TIL_TRUE;
+}
+
+/* JSON -> TIL */
+
+static int skip_json_space(til_transcoder_t* t)
+{
+    int c = input_peek(t);
+    while (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+    {
+        c = input_next(t);
+    }
+    return c;
+}
+
+static int hex_digits(const char* text)
+{
+    int value = 0;
+
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        int c = (unsigned char)text[i];
+        if (c >= '0' && c <= '9')
+        {
+            value = value * 16 + c - '0';
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            value = value * 16 + c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            value = value * 16 + c - 'A' + 10;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    return value;
+}
+
+/* Decodes the escape sequence at the cursor into at most 4 bytes of UTF-8 */
+static int json_unescape(til_transcoder_t* t, char* buffer)
+{
+    if (input_fill(t, 12) < 2)
+    {
+        return 0;
+    }
+
+    const char* text = t->input + t->cursor;
+    int         code = 0;
+    switch (text[1])
+    {
+    case '\\': buffer[0] = '\\'; t->cursor += 2; return 1;
+    case '/':  buffer[0] = '/';  t->cursor += 2; return 1;
+    case 'b':  buffer[0] = '\b'; t->cursor += 2; return 1;
+    case 'f':  buffer[0] = '\f'; t->cursor += 2; return 1;
+    case 'n':  buffer[0] = '\n'; t->cursor += 2; return 1;
+    case 'r':  buffer[0] = '\r'; t->cursor += 2; return 1;
+    case 't':  buffer[0] = '\t'; t->cursor += 2; return 1;
+
+    case 'u':
+        if (t->count - t->cursor < 6 || (code = hex_digits(text + 2)) < 0)
+        {
+            return 0;
+        }
+        t->cursor += 6;
+
+        /* A surrogate pair is two escapes */
+        if (code >= 0xd800 && code < 0xdc00)
+        {
+            int low = t->count - t->cursor >= 6 && text[6] == '\\' && text[7] == 'u' ? hex_digits(text + 8) : -1;
+            if (low < 0xdc00 || low >= 0xe000)
+            {
+                return 0;
+            }
+
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            t->cursor += 6;
+        }
+        else if (code >= 0xdc00 && code < 0xe000)
+        {
+            return 0;
+        }
+        break;
+
+    default:
+        /* '"' (escaped or not) cannot be written in a TIL string */
+        return 0;
+    }
+
+    if (code == '"' || code == 0)
+    {
+        return 0;
+    }
+    else if (code < 0x80)
+    {
+        buffer[0] = (char)code;
+        return 1;
+    }
+    else if (code < 0x800)
+    {
+        buffer[0] = (char)(0xc0 | (code >> 6));
+        buffer[1] = (char)(0x80 | (code & 0x3f));
+        return 2;
+    }
+    else if (code < 0x10000)
+    {
+        buffer[0] = (char)(0xe0 | (code >> 12));
+        buffer[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+        buffer[2] = (char)(0x80 | (code & 0x3f));
+        return 3;
     }
     else
     {
-        next_char(state);
-
-        til_value_t* value  = make_value(state, TIL_TABLE);
-        value->table.length = length;
-        value->table.values = values;
-        return value;
+        buffer[0] = (char)(0xf0 | (code >> 18));
+        buffer[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+        buffer[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+        buffer[3] = (char)(0x80 | (code & 0x3f));
+        return 4;
     }
 }
 
-static til_state_t* root_state = NULL;
-
-/* @funcdef: til_parse */
-til_value_t* til_parse(const char* code, til_state_t** out_state)
+/* Decodes a JSON string, the cursor is after the opening quote. The bytes go
+ * to head until it is full (then 1 is returned with the rest of the string
+ * unread), or to the output when head is NULL. 0 when the string ended.
+ */
+static int json_string_to_til(til_transcoder_t* t, char* head, int capacity, int* head_length, til_bool_t* ok)
 {
-    til_state_t* state = make_state(code);
-    if (!state)
-    {
-        return NULL;
-    }
+    char bytes[4];
 
-    if (skip_space_and_comment(state) == '{')
+    *ok = TIL_FALSE;
+    for (;;)
     {
-        til_value_t* value = parse_table(state);
-        if (value)
+        int c = input_peek(t);
+        if (c < 0)
+        {
+            return 0;
+        }
+        else if (c == '"')
+        {
+            t->cursor++;
+            *ok = TIL_TRUE;
+            return 0;
+        }
+        else if (c == '\\')
         {
-            if (out_state)
+            if (head && *head_length + 4 > capacity)
+            {
+                *ok = TIL_TRUE;
+                return 1;
+            }
+
+            int length = json_unescape(t, bytes);
+            if (length == 0)
             {
-                *out_state = state;
+                return 0;
+            }
+
+            if (head)
+            {
+                memcpy(head + *head_length, bytes, length);
+                *head_length += length;
             }
             else
             {
-                if (root_state)
-                {
-                    root_state->next = state;
-                }
-                root_state = state;
+                output_write(t, bytes, length);
             }
-            return value;
+        }
+        else if (c < 0x20)
+        {
+            return 0;
         }
         else
         {
-            if (out_state)
+            const char* data  = t->input + t->cursor;
+            int         count = t->count - t->cursor;
+            int         i;
+            for (i = 0; i < count && data[i] != '"' && data[i] != '\\' && (unsigned char)data[i] >= 0x20; i++)
             {
-                *out_state = NULL;
             }
-            free_state(state);
-            return NULL;
+
+            if (head)
+            {
+                if (i > capacity - *head_length)
+                {
+                    i = capacity - *head_length;
+                }
+                if (i == 0)
+                {
+                    *ok = TIL_TRUE;
+                    return 1;
+                }
+
+                memcpy(head + *head_length, data, i);
+                *head_length += i;
+            }
+            else
+            {
+                output_write(t, data, i);
+            }
+            t->cursor += i;
         }
     }
-    else
-    {
-        return NULL;
-    }
 }
 
-/* @funcdef: til_release */
-void til_release(til_state_t* state)
+/* Keys that are symbols are written bare, others as ["string"] */
+static til_bool_t json_key_to_til(til_transcoder_t* t)
 {
-    if (state)
+    char       head[64];
+    int        length = 0;
+    til_bool_t ok;
+
+    t->cursor++;
+    int more = json_string_to_til(t, head, sizeof(head), &length, &ok);
+    if (!ok)
     {
-        free_state(state);
+        return TIL_FALSE;
     }
-    else
+
+    if (!more && is_symbol(head, length))
     {
-        free_state(root_state);
-        root_state = NULL;
+        output_write(t, head, length);
+        return TIL_TRUE;
     }
+
+    output_write(t, "[\"", 2);
+    output_write(t, head, length);
+    if (more)
+    {
+        json_string_to_til(t, NULL, 0, NULL, &ok);
+        if (!ok)
+        {
+            return TIL_FALSE;
+        }
+    }
+    output_write(t, "\"]", 2);
+    return TIL_TRUE;
 }
 
-void til_print(const til_value_t* value, FILE* out)
+/* Number being read by json_number_to_til() */
+typedef struct til_number_token_t
 {
-    if (value)
-    {
-        int i, n;
-        static int indent = 0;
+    char       text[TIL_NUMBER_TOKEN];
+    int        length;
+    til_bool_t spilled;     /* the start was written out to make room */
+} til_number_token_t;
 
-        switch (value->type)
-        {
-        case TIL_NIL:
-            fprintf(out, "null");
-            break;
+/* Appends c to the token, returns the next char of the input */
+static int keep_number_char(til_transcoder_t* t, til_number_token_t* token, int c)
+{
+    if (token->length == TIL_NUMBER_TOKEN - 1)
+    {
+        output_write(t, token->text, token->length);
+        token->length  = 0;
+        token->spilled = TIL_TRUE;
+    }
 
-        case TIL_NUMBER:
-            fprintf(out, "%lf", value->number);
-            break;
+    token->text[token->length++] = (char)c;
+    return input_next(t);
+}
 
-        case TIL_BOOLEAN:
-            fprintf(out, "%s", value->boolean ? "true" : "false");
-            break;
+/* JSON numbers may have an exponent, TIL numbers cannot. Without one the
+ * digits are TIL already and copied whatever their length.
+ */
+static til_bool_t json_number_to_til(til_transcoder_t* t)
+{
+    til_number_token_t token;
+    token.length  = 0;
+    token.spilled = TIL_FALSE;
 
-        case TIL_STRING:
-            fprintf(out, "\"%s\"", value->string.buffer);
-            break;
+    til_bool_t nonzero = TIL_FALSE;
 
-        case TIL_ARRAY:
-            fprintf(out, "[\n");
+    /* -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)? */
+    int c = input_peek(t);
+    if (c == '-')
+    {
+        c = keep_number_char(t, &token, c);
+    }
 
-            indent++;
-            for (i = 0, n = value->array.length; i < n; i++)
-            {
-                int j, m;
-                for (j = 0, m = indent * 4; j < m; j++)
-                {
-                    fprintf(out, " ");
-                }
+    if (c == '0')
+    {
+        c = keep_number_char(t, &token, c);
+    }
+    else if (isdigit(c))
+    {
+        nonzero = TIL_TRUE;
+        while (isdigit(c))
+        {
+            c = keep_number_char(t, &token, c);
+        }
+    }
+    else
+    {
+        return TIL_FALSE;
+    }
 
-                til_print(&value->array.values[i], out);
-                if (i < n - 1)
-                {
-                    fprintf(out, ",");
-                }
-                fprintf(out, "\n");
-            }
-            indent--;
+    if (c == '.')
+    {
+        c = keep_number_char(t, &token, c);
+        if (!isdigit(c))
+        {
+            return TIL_FALSE;
+        }
 
-            for (i = 0, n = indent * 4; i < n; i++)
+        while (isdigit(c))
+        {
+            if (c != '0')
             {
-                fprintf(out, " ");
+                nonzero = TIL_TRUE;
             }
-            fprintf(out, "]");
-            break;
+            c = keep_number_char(t, &token, c);
+        }
+    }
 
-        case TIL_TABLE:
-            fprintf(out, "{\n");
+    if (c != 'e' && c != 'E')
+    {
+        output_write(t, token.text, token.length);
+        return is_number_end(c, "+-.0123456789");
+    }
 
-            indent++;
-            for (i = 0, n = value->table.length; i < n; i++)
-            {
-                int j, m;
-                for (j = 0, m = indent * 4; j < m; j++)
-                {
-                    fprintf(out, " ");
-                }
+    c = keep_number_char(t, &token, c);
+    if (c == '+' || c == '-')
+    {
+        c = keep_number_char(t, &token, c);
+    }
 
-                til_print(&value->table.values[i].name, out);
-                fprintf(out, " = ");
-                til_print(&value->table.values[i].value, out);
-                fprintf(out, ";\n");
-            }
-            indent--;
+    if (!isdigit(c))
+    {
+        return TIL_FALSE;
+    }
 
-            for (i = 0, n = indent * 4; i < n; i++)
-            {
-                fprintf(out, " ");
-            }
-            fprintf(out, "}");
-            break;
+    while (isdigit(c))
+    {
+        c = keep_number_char(t, &token, c);
+    }
 
-        default:
-            break;
-        }
+    /* strtod() needs the whole token */
+    if (token.spilled || !is_number_end(c, "+-.eE0123456789"))
+    {
+        return TIL_FALSE;
     }
-}
+    token.text[token.length] = 0;
 
-void til_write(const til_value_t* value, FILE* out)
-{
-    if (value)
+    /* Written with exact digits, unless it overflows or underflows to zero */
+    double number = strtod(token.text, NULL);
+    if (number - number != 0 || (number == 0 && nonzero))
     {
-        int i, n;
-        static int indent = 0;
+        return TIL_FALSE;
+    }
 
-        switch (value->type)
-        {
-        case TIL_NIL:
-            fprintf(out, "null");
-            break;
+    char text[TIL_NUMBER_TOKEN];
+    output_write(t, text, format_code_number(text, number));
+    return TIL_TRUE;
+}
 
-        case TIL_NUMBER:
-            fprintf(out, "%lf", value->number);
-            break;
+static til_bool_t json_value_to_til(til_transcoder_t* t, int c)
+{
+    til_bool_t ok;
 
-        case TIL_BOOLEAN:
-            fprintf(out, "%s", value->boolean ? "true" : "false");
-            break;
+    if (c == '"')
+    {
+        t->cursor++;
+        output_char(t, '"');
+        json_string_to_til(t, NULL, 0, NULL, &ok);
+        output_char(t, '"');
+        return ok;
+    }
+    else if (c == '-' || isdigit(c))
+    {
+        return json_number_to_til(t);
+    }
+    else if (read_keyword(t, "null", 4))
+    {
+        output_write(t, "nil", 3);
+        return TIL_TRUE;
+    }
+    else if (read_keyword(t, "true", 4))
+    {
+        output_write(t, "true", 4);
+        return TIL_TRUE;
+    }
+    else if (read_keyword(t, "false", 5))
+    {
+        output_write(t, "false", 5);
+        return TIL_TRUE;
+    }
+    return TIL_FALSE;
+}
 
-        case TIL_STRING:
-            fprintf(out, "\"%s\"", value->string.buffer);
-            break;
+static til_bool_t til_from_json_loop(til_transcoder_t* t)
+{
+    /* A TIL document is a table */
+    if (skip_json_space(t) != '{' || !push_container(t, TIL_TABLE))
+    {
+        return TIL_FALSE;
+    }
+    output_char(t, '{');
 
-        case TIL_ARRAY:
-            fprintf(out, "[\n");
+    while (t->stack.count > 0)
+    {
+        int type = t->stack.data[t->stack.count - 1];
+        int c    = skip_json_space(t);
 
-            indent++;
-            for (i = 0, n = value->array.length; i < n; i++)
+        if (c == (type == TIL_TABLE ? '}' : ']'))
+        {
+            output_char(t, (char)c);
+            type = pop_container(t);
+        }
+        else
+        {
+            if (t->members > 0)
             {
-                int j, m;
-                for (j = 0, m = indent * 4; j < m; j++)
+                if (c != ',')
                 {
-                    fprintf(out, " ");
+                    return TIL_FALSE;
                 }
 
-                til_write(&value->array.values[i], out);
-                if (i < n - 1)
+                t->cursor++;
+                c = skip_json_space(t);
+                if (type == TIL_ARRAY)
                 {
-                    fprintf(out, ",");
+                    output_char(t, ',');
                 }
-                fprintf(out, "\n");
             }
-            indent--;
+            t->members++;
 
-            for (i = 0, n = indent * 4; i < n; i++)
+            if (type == TIL_TABLE)
             {
-                fprintf(out, " ");
-            }
-            fprintf(out, "]");
-            break;
+                if (c != '"' || !json_key_to_til(t) || skip_json_space(t) != ':')
+                {
+                    return TIL_FALSE;
+                }
 
-        case TIL_TABLE:
-            fprintf(out, "{\n");
+                t->cursor++;
+                output_char(t, '=');
+                c = skip_json_space(t);
+            }
 
-            indent++;
-            for (i = 0, n = value->table.length; i < n; i++)
+            if (c == '{' || c == '[')
             {
-                int j, m;
-                for (j = 0, m = indent * 4; j < m; j++)
+                if (!push_container(t, c == '{' ? TIL_TABLE : TIL_ARRAY))
                 {
-                    fprintf(out, " ");
+                    return TIL_FALSE;
                 }
 
-                til_write(&value->table.values[i].name, out);
-                fprintf(out, " = ");
-                til_write(&value->table.values[i].value, out);
-                if (i < n - 1)
-                {
-                    fprintf(out, ";");
-                }
-                fprintf(out, "\n");
+                output_char(t, (char)c);
+                continue;
             }
-            indent--;
-
-            for (i = 0, n = indent * 4; i < n; i++)
+            else if (!json_value_to_til(t, c))
             {
-                fprintf(out, " ");
+                return TIL_FALSE;
             }
-            fprintf(out, "}");
-            break;
+        }
 
-        default:
-            break;
+        /* A finished cell value is followed by ';' */
+        if (type == TIL_TABLE)
+        {
+            output_char(t, ';');
         }
     }
+
+    output_char(t, '\n');
+    return skip_json_space(t) < 0 ? TIL_TRUE : TIL_FALSE;
+}
+
+static til_bool_t transcode(FILE* in, FILE* out, til_bool_t (*loop)(til_transcoder_t*))
+{
+    if (!in || !out)
+    {
+        return TIL_FALSE;
+    }
+
+    til_transcoder_t* t = (til_transcoder_t*)malloc(sizeof(til_transcoder_t));
+    if (!t)
+    {
+        return TIL_FALSE;
+    }
+
+    t->in      = in;
+    t->cursor  = 0;
+    t->count   = 0;
+    t->failed  = TIL_FALSE;
+    t->out     = out;
+    t->written = 0;
+    t->members = 0;
+
+    t->stack.count     = 0;
+    t->stack.capacity  = 0;
+    t->stack.data      = NULL;
+    t->counts.count    = 0;
+    t->counts.capacity = 0;
+    t->counts.data     = NULL;
+
+    til_bool_t ok = loop(t) && !t->failed ? TIL_TRUE : TIL_FALSE;
+    output_flush(t);
+
+    free(t->stack.data);
+    free(t->counts.data);
+    free(t);
+    return ok;
+}
+
+/* @funcdef: til_to_json */
+til_bool_t til_to_json(FILE* in, FILE* out)
+{
+    return transcode(in, out, til_to_json_loop);
+}
+
+/* @funcdef: til_from_json */
+til_bool_t til_from_json(FILE* in, FILE* out)
+{
+    return transcode(in, out, til_from_json_loop);
 }
 
 /* END OF TIL_IMPL */
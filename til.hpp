@@ -0,0 +1,366 @@
+#ifndef __TIL_HPP__
+#define __TIL_HPP__
+
+/* C++17 layer over til.h
+ *
+ *   til::document doc = til::document::parse(code);
+ *   if (doc)
+ *   {
+ *       double memory = doc["limits"]["memory"].as_number();
+ *       for (auto entry : doc.root()) { ... entry.name ... entry.value ... }
+ *   }
+ *
+ * Handles only point into the document, nothing is copied or allocated on
+ * the access path. They are valid as long as the document is alive.
+ */
+
+#include "til.h"
+
+#include <cstring>
+#include <cstddef>
+#include <utility>
+#include <string_view>
+
+namespace til
+{
+    class table_ref;
+    class array_ref;
+
+    /* A value in a document, or nil when a lookup failed */
+    class value_ref
+    {
+    public:
+        value_ref() = default;
+
+        explicit value_ref(const til_value_t* value)
+            : value_(value)
+        {
+        }
+
+        /* Element of a packed number array */
+        explicit value_ref(const double* number)
+            : number_(number)
+        {
+        }
+
+        til_type_t type() const
+        {
+            return number_ ? TIL_NUMBER : value_ ? value_->type : TIL_NIL;
+        }
+
+        bool is_nil() const     { return type() == TIL_NIL; }
+        bool is_number() const  { return type() == TIL_NUMBER; }
+        bool is_boolean() const { return type() == TIL_BOOLEAN; }
+        bool is_string() const  { return type() == TIL_STRING; }
+        bool is_array() const   { return type() == TIL_ARRAY; }
+        bool is_table() const   { return type() == TIL_TABLE; }
+
+        /* False when the value does not exist, a nil value exists */
+        explicit operator bool() const
+        {
+            return number_ || value_;
+        }
+
+        double as_number(double fallback = 0) const
+        {
+            return number_ ? *number_ : is_number() ? value_->number : fallback;
+        }
+
+        bool as_boolean(bool fallback = false) const
+        {
+            return is_boolean() ? value_->boolean != TIL_FALSE : fallback;
+        }
+
+        std::string_view as_string(std::string_view fallback = {}) const
+        {
+            return is_string() ? std::string_view(value_->string.buffer, value_->string.length) : fallback;
+        }
+
+        inline table_ref as_table() const;
+        inline array_ref as_array() const;
+
+        inline value_ref operator[](std::string_view name) const;
+        inline value_ref operator[](int index) const;
+
+        /* Underlying C value, null for elements of packed arrays */
+        const til_value_t* get() const
+        {
+            return value_;
+        }
+
+    private:
+        const til_value_t* value_  = nullptr;
+        const double*      number_ = nullptr;
+    };
+
+    struct table_entry
+    {
+        std::string_view name;
+        value_ref        value;
+    };
+
+    class table_ref
+    {
+    public:
+        class iterator
+        {
+        public:
+            explicit iterator(const til_cell_t* cell)
+                : cell_(cell)
+            {
+            }
+
+            table_entry operator*() const
+            {
+                return { std::string_view(cell_->name.string.buffer, cell_->name.string.length), value_ref(&cell_->value) };
+            }
+
+            iterator& operator++()
+            {
+                ++cell_;
+                return *this;
+            }
+
+            bool operator==(const iterator& other) const { return cell_ == other.cell_; }
+            bool operator!=(const iterator& other) const { return cell_ != other.cell_; }
+
+        private:
+            const til_cell_t* cell_;
+        };
+
+        table_ref() = default;
+
+        /* Empty when value is not a table */
+        explicit table_ref(const til_value_t* value)
+            : table_(value && value->type == TIL_TABLE ? value : nullptr)
+        {
+        }
+
+        int size() const
+        {
+            return table_ ? table_->table.length : 0;
+        }
+
+        bool empty() const
+        {
+            return size() == 0;
+        }
+
+        iterator begin() const
+        {
+            return iterator(table_ ? table_->table.values : nullptr);
+        }
+
+        iterator end() const
+        {
+            return iterator(table_ ? table_->table.values + table_->table.length : nullptr);
+        }
+
+        value_ref operator[](std::string_view name) const
+        {
+            int i, n;
+            for (i = 0, n = size(); i < n; i++)
+            {
+                const til_cell_t& cell = table_->table.values[i];
+                if ((size_t)cell.name.string.length == name.size()
+                    && std::memcmp(cell.name.string.buffer, name.data(), name.size()) == 0)
+                {
+                    return value_ref(&cell.value);
+                }
+            }
+            return value_ref();
+        }
+
+        const til_value_t* get() const
+        {
+            return table_;
+        }
+
+    private:
+        const til_value_t* table_ = nullptr;
+    };
+
+    class array_ref
+    {
+    public:
+        class iterator
+        {
+        public:
+            iterator(const til_value_t* array, int index)
+                : array_(array)
+                , index_(index)
+            {
+            }
+
+            value_ref operator*() const
+            {
+                return array_->array.kind == TIL_ARRAY_NUMBERS
+                    ? value_ref(&array_->array.numbers[index_])
+                    : value_ref(&array_->array.values[index_]);
+            }
+
+            iterator& operator++()
+            {
+                ++index_;
+                return *this;
+            }
+
+            bool operator==(const iterator& other) const { return index_ == other.index_; }
+            bool operator!=(const iterator& other) const { return index_ != other.index_; }
+
+        private:
+            const til_value_t* array_;
+            int                index_;
+        };
+
+        array_ref() = default;
+
+        /* Empty when value is not an array */
+        explicit array_ref(const til_value_t* value)
+            : array_(value && value->type == TIL_ARRAY ? value : nullptr)
+        {
+        }
+
+        int size() const
+        {
+            return array_ ? array_->array.length : 0;
+        }
+
+        bool empty() const
+        {
+            return size() == 0;
+        }
+
+        /* Contiguous elements of a packed number array, null otherwise */
+        const double* numbers() const
+        {
+            return til_array_numbers(array_);
+        }
+
+        iterator begin() const
+        {
+            return iterator(array_, 0);
+        }
+
+        iterator end() const
+        {
+            return iterator(array_, size());
+        }
+
+        value_ref operator[](int index) const
+        {
+            if (index < 0 || index >= size())
+            {
+                return value_ref();
+            }
+            return *iterator(array_, index);
+        }
+
+        const til_value_t* get() const
+        {
+            return array_;
+        }
+
+    private:
+        const til_value_t* array_ = nullptr;
+    };
+
+    inline table_ref value_ref::as_table() const
+    {
+        return table_ref(value_);
+    }
+
+    inline array_ref value_ref::as_array() const
+    {
+        return array_ref(value_);
+    }
+
+    inline value_ref value_ref::operator[](std::string_view name) const
+    {
+        return as_table()[name];
+    }
+
+    inline value_ref value_ref::operator[](int index) const
+    {
+        return as_array()[index];
+    }
+
+    /* Owns a parsed document, released with it. The code is not copied:
+     * keep it alive to use til_write_patch() on the state.
+     */
+    class document
+    {
+    public:
+        document() = default;
+
+        document(const document&) = delete;
+        document& operator=(const document&) = delete;
+
+        document(document&& other) noexcept
+            : state_(std::exchange(other.state_, nullptr))
+            , root_(std::exchange(other.root_, nullptr))
+        {
+        }
+
+        document& operator=(document&& other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                state_ = std::exchange(other.state_, nullptr);
+                root_  = std::exchange(other.root_, nullptr);
+            }
+            return *this;
+        }
+
+        ~document()
+        {
+            reset();
+        }
+
+        /* Empty document when the code does not parse */
+        static document parse(const char* code, const til_options_t* options = nullptr)
+        {
+            document doc;
+            doc.root_ = til_parse_ex(code, options, &doc.state_);
+            return doc;
+        }
+
+        explicit operator bool() const
+        {
+            return root_ != nullptr;
+        }
+
+        table_ref root() const
+        {
+            return table_ref(root_);
+        }
+
+        value_ref operator[](std::string_view name) const
+        {
+            return root()[name];
+        }
+
+        til_state_t* state() const
+        {
+            return state_;
+        }
+
+        void reset()
+        {
+            if (state_)
+            {
+                til_release(state_);
+            }
+
+            state_ = nullptr;
+            root_  = nullptr;
+        }
+
+    private:
+        til_state_t* state_ = nullptr;
+        til_value_t* root_  = nullptr;
+    };
+}
+
+#endif /* __TIL_HPP__ */
@@ -142,13 +142,10 @@ function parsenumber(state)
     local chr = skipredundant(state)
     local sign = 1
     if chr == CHAR_0 then
-        chr = string.byte(state.buffer, state.cursor)
-        if isnumber(chr) then
+        local nxt = string.byte(state.buffer, state.cursor + 1)
+        if nxt and isdigit(nxt) then
             error("Number starting with '0' is not supported")
-        elseif chr ~= CHAR_DOT then
-            return 0
         end
-        chr = peekchar(state)
     elseif chr == CHAR_PLUS then 
         error("Number starting with '+' is not supported")
     elseif chr == CHAR_MINUS then
@@ -192,7 +189,6 @@ function parsenumber(state)
         error("After dot must be a digit")
     end
 
-    print(num)
     return sign * num
 end
 
@@ -212,7 +208,8 @@ function parsestring(state)
             error("Unterminated string")
         end
 
-        return string.sub(state.buffer, state.cursor - len, state.cursor)
+        nextchar(state)
+        return string.sub(state.buffer, state.cursor - len - 1, state.cursor - 2)
     end
 end
 
@@ -237,7 +234,7 @@ function parsearray(state)
                 break
             end
             
-            result[#result] = value
+            result[#result + 1] = value
         end
 
         if peekchar(state) ~= CHAR_BRACKS_1 then
@@ -316,7 +313,7 @@ function parsesingle(state)
 
         if c == CHAR_BRACES_0 then
             return parsetable(state)
-        elseif c == CHAR_BRACKS_1 then
+        elseif c == CHAR_BRACKS_0 then
             return parsearray(state)
         elseif c == CHAR_QUOTATION then
             return parsestring(state)
@@ -365,12 +362,13 @@ function isarray(value)
             return false
         end
     end
+    return i > 0
 end
 
 function tiltostring(value)
     if type(value) == "table" then
         local result = ""
-        if isarray(table) then
+        if isarray(value) then
             result = result .. "["
             
             for k, v in pairs(value) do
@@ -378,7 +376,7 @@ function tiltostring(value)
                     result = result .. ","
                 end
 
-                result = result .. v
+                result = result .. tiltostring(v)
             end
 
             result = result .. "]"    
@@ -388,15 +386,17 @@ function tiltostring(value)
             for k, v in pairs(value) do
                 result = result .. k
                 result = result .. "="
-                result = result .. v
+                result = result .. tiltostring(v)
                 result = result .. ";"
             end
             
             result = result .. "}"
         end
         return result
+    elseif type(value) == "string" then
+        return "\"" .. value .. "\""
     else
-        return value
+        return tostring(value)
     end
 end
 
@@ -0,0 +1,615 @@
+/* til_bench - benchmarks of til.h
+ *
+ * Build & run:
+ *   cc -O2 -o til_bench til_bench.c -lpthread
+ *   ./til_bench [name]
+ */
+
+#define TIL_IMPL
+#include "til.h"
+
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* A config made of many entries that repeat the same nested blocks */
+static char* make_records(int count)
+{
+    size_t capacity = 256 + (size_t)count * 256;
+    char*  code     = (char*)malloc(capacity);
+    size_t length   = 0;
+
+    int i;
+    length += sprintf(code + length, "{\n");
+    for (i = 0; i < count; i++)
+    {
+        length += sprintf(code + length,
+                          "    entry%d = {\n"
+                          "        id = %d;\n"
+                          "        service = \"worker\";\n"
+                          "        limits = { cpu = 2; memory = 512; burst = [ 1, 2, 4, 8 ]; };\n"
+                          "        tags = [ \"prod\", \"eu\", true ];\n"
+                          "    };\n",
+                          i, i % 16);
+    }
+    length += sprintf(code + length, "}\n");
+    return code;
+}
+
+/* One edit deep in a large document, written back by til_write_patch */
+static void bench_patch(void)
+{
+    char* code = make_records(20000);
+
+    til_state_t* state;
+    til_value_t* root = til_parse(code, &state);
+
+    til_value_t memory;
+    memset(&memory, 0, sizeof(memory));
+    memory.type   = TIL_NUMBER;
+    memory.number = 1024;
+    til_table_set(state, til_table_get(til_table_get(root, "entry42"), "limits"), "memory", &memory);
+
+    /* Baseline: the source written as is, once the file has its pages */
+    FILE* file = tmpfile();
+    fwrite(code, 1, strlen(code), file);
+
+    rewind(file);
+    double start = now();
+    fwrite(code, 1, strlen(code), file);
+    double copy_time = now() - start;
+
+    rewind(file);
+    start = now();
+    til_write_patch(state, root, file);
+    double patch_time = now() - start;
+
+    printf("patch: %d bytes of code, 1 edit\n", (int)strlen(code));
+    printf("  fwrite           %8.3f ms\n", copy_time * 1000);
+    printf("  til_write_patch  %8.3f ms\n", patch_time * 1000);
+
+    fclose(file);
+    til_release(state);
+    free(code);
+}
+
+static void bench_hashcons(void)
+{
+    char* code = make_records(20000);
+
+    til_options_t options = { TIL_PARSE_HASHCONS, 0 };
+    til_state_t*  plain;
+    til_state_t*  shared;
+
+    double start = now();
+    til_parse(code, &plain);
+    double plain_time = now() - start;
+
+    start = now();
+    til_parse_ex(code, &options, &shared);
+    double shared_time = now() - start;
+
+    til_stats_t plain_stats, shared_stats;
+    til_stats(plain, &plain_stats);
+    til_stats(shared, &shared_stats);
+
+    printf("hashcons: %d bytes of code\n", (int)strlen(code));
+    printf("  default   %10d bytes %8.2f ms\n", (int)plain_stats.allocated, plain_time * 1000);
+    printf("  hashcons  %10d bytes %8.2f ms (%d storages reused, %d bytes saved, %.1fx smaller)\n",
+           (int)shared_stats.allocated, shared_time * 1000, shared_stats.shared_count, (int)shared_stats.shared,
+           (double)plain_stats.allocated / shared_stats.allocated);
+
+    til_release(plain);
+    til_release(shared);
+    free(code);
+}
+
+static void bench_binary(void)
+{
+    char* code = make_records(20000);
+
+    double start = now();
+    til_state_t* state;
+    til_value_t* value = til_parse(code, &state);
+    double parse_time = now() - start;
+
+    til_save_binary(value, "til_bench.bin");
+
+    start = now();
+    til_image_t* image = til_load_binary("til_bench.bin");
+    double load_time = now() - start;
+
+    const til_node_t* entry = til_node_get(image, til_image_root(image), "entry19999");
+    printf("binary: %d bytes of code\n", (int)strlen(code));
+    printf("  til_parse        %10.3f ms\n", parse_time * 1000);
+    printf("  til_load_binary  %10.3f ms (entry19999.id = %g)\n", load_time * 1000,
+           til_node_get(image, entry, "id")->number);
+
+    til_unload_binary(image);
+    til_release(state);
+    remove("til_bench.bin");
+    free(code);
+}
+
+static double parse_throughput(const char* code, int flags, int iterations)
+{
+    til_options_t options = { flags, 0 };
+    double        start   = now();
+
+    int i;
+    for (i = 0; i < iterations; i++)
+    {
+        til_state_t* state;
+        til_parse_ex(code, &options, &state);
+        til_release(state);
+    }
+
+    return strlen(code) * (double)iterations / (now() - start) / (1024 * 1024);
+}
+
+static void bench_iterative(void)
+{
+    char* code = make_records(20000);
+
+    printf("iterative: %d bytes of code\n", (int)strlen(code));
+    printf("  recursive  %8.2f MB/s\n", parse_throughput(code, TIL_PARSE_RECURSIVE, 20));
+    printf("  iterative  %8.2f MB/s\n", parse_throughput(code, TIL_PARSE_DEFAULT, 20));
+
+    free(code);
+}
+
+/* An event log, one record per line */
+static char* make_log(int count, size_t* size)
+{
+    char*  code   = (char*)malloc((size_t)count * 192 + 1);
+    size_t length = 0;
+
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        length += sprintf(code + length,
+                          "{ seq = %d; level = \"info\"; service = \"worker%d\"; latency = [ %d.5, %d, 12 ]; "
+                          "request = { method = \"GET\"; status = 200; }; }\n",
+                          i, i % 64, i % 100, i % 7);
+    }
+    *size = length;
+    return code;
+}
+
+/* Records consumed per second, each batch is walked like a replay would */
+static double stream_throughput(til_stream_t* stream, size_t size, int count)
+{
+    double      start = now();
+    til_batch_t batch;
+    int         records = 0;
+
+    while (til_stream_next(stream, &batch))
+    {
+        records += batch.count;
+    }
+
+    double elapsed = now() - start;
+    if (records != count || til_stream_error(stream) >= 0)
+    {
+        printf("  stream failed at %lld after %d records\n", til_stream_error(stream), records);
+    }
+
+    til_stream_close(stream);
+    return size / elapsed / (1024 * 1024);
+}
+
+static void bench_stream(void)
+{
+    size_t size;
+    int    count = 400000;
+    char*  code  = make_log(count, &size);
+
+    printf("stream: %d records, %d bytes\n", count, (int)size);
+
+    /* Baseline: split lines by hand, copy and parse each record */
+    double start  = now();
+    char*  record = (char*)malloc(size + 1);
+    char*  line   = code;
+    while (line < code + size)
+    {
+        char*  end    = (char*)memchr(line, '\n', code + size - line);
+        size_t length = end ? (size_t)(end - line) : (size_t)(code + size - line);
+
+        memcpy(record, line, length);
+        record[length] = 0;
+
+        til_state_t* state;
+        til_parse(record, &state);
+        til_release(state);
+
+        line += length + 1;
+    }
+    free(record);
+    printf("  split + til_parse  %8.2f MB/s\n", size / (now() - start) / (1024 * 1024));
+
+    til_stream_options_t options = { { TIL_PARSE_DEFAULT, 0 }, 0, 0 };
+    printf("  til_stream         %8.2f MB/s\n", stream_throughput(til_stream_buffer(code, size, &options), size, count));
+
+    int threads;
+    for (threads = 2; threads <= 8; threads *= 2)
+    {
+        options.threads = threads;
+        printf("  til_stream %d thr   %8.2f MB/s\n", threads,
+               stream_throughput(til_stream_buffer(code, size, &options), size, count));
+    }
+
+    /* Same from a file, mapped */
+    FILE* file = fopen("til_bench.log", "wb");
+    if (file)
+    {
+        fwrite(code, 1, size, file);
+        fclose(file);
+
+        options.threads = 4;
+        printf("  file, 4 thr        %8.2f MB/s\n", stream_throughput(til_stream_open("til_bench.log", &options), size, count));
+        remove("til_bench.log");
+    }
+
+    free(code);
+}
+
+static void bench_overlay(void)
+{
+    char* code = make_records(20000);
+
+    til_state_t* base;
+    til_state_t* patch;
+    til_value_t* base_root  = til_parse(code, &base);
+    til_value_t* patch_root = til_parse("{ entry42 = { limits = { memory = 1024; }; }; entry7 = nil; }", &patch);
+
+    /* Baseline: deep copy of the base, then the keys of the patch set over it */
+    double start = now();
+
+    til_state_t* copy;
+    til_value_t* copy_root = til_parse("{}", &copy);
+    copy_value(copy, copy_root, base_root);
+
+    int i;
+    for (i = 0; i < patch_root->table.length; i++)
+    {
+        const til_cell_t* cell = &patch_root->table.values[i];
+        if (cell->value.type == TIL_NIL)
+        {
+            til_table_remove(copy, copy_root, cell->name.string.buffer);
+        }
+        else
+        {
+            til_table_set(copy, copy_root, cell->name.string.buffer, &cell->value);
+        }
+    }
+    double copy_time = now() - start;
+
+    start = now();
+    til_state_t* merged;
+    til_overlay(base, patch, TIL_MERGE_NIL_DELETES, &merged);
+    double overlay_time = now() - start;
+
+    til_stats_t copy_stats, merged_stats;
+    til_stats(copy, &copy_stats);
+    til_stats(merged, &merged_stats);
+
+    printf("overlay: %d bytes of base, %d keys in the patch\n", (int)strlen(code), patch_root->table.length);
+    printf("  deep copy    %10d bytes %8.3f ms\n", (int)copy_stats.allocated, copy_time * 1000);
+    printf("  til_overlay  %10d bytes %8.3f ms\n", (int)merged_stats.allocated, overlay_time * 1000);
+
+    til_release(copy);
+    til_release(merged);
+    til_release(patch);
+    til_release(base);
+    free(code);
+}
+
+#if !defined(_WIN32)
+#include <pthread.h>
+
+/* Readers look up a key of the current config while a writer reloads it */
+typedef struct bench_config_t
+{
+    til_snapshot_t*  snapshot;
+    pthread_rwlock_t lock;
+    til_state_t*     state;
+    til_value_t*     root;
+    int              use_snapshot;
+    double           deadline;
+    long long        reads;
+    int              reloads;
+} bench_config_t;
+
+static void* config_reader(void* arg)
+{
+    bench_config_t* config = (bench_config_t*)arg;
+    long long       reads  = 0;
+    double          sum    = 0;
+
+    /* Readers stop on their own, a writer starved by the rwlock would never stop them */
+    while ((reads & 1023) || now() < config->deadline)
+    {
+        if (config->use_snapshot)
+        {
+            int ticket;
+            sum += til_table_get(til_snapshot_acquire(config->snapshot, &ticket), "entry3")->span.end;
+            til_snapshot_release(config->snapshot, ticket);
+        }
+        else
+        {
+            pthread_rwlock_rdlock(&config->lock);
+            sum += til_table_get(config->root, "entry3")->span.end;
+            pthread_rwlock_unlock(&config->lock);
+        }
+        reads++;
+    }
+
+    __atomic_fetch_add(&config->reads, reads + (sum < 0), __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void measure_reads(const char* code, int use_snapshot, int readers)
+{
+    bench_config_t config;
+    config.use_snapshot = use_snapshot;
+    config.deadline     = now() + 0.5;
+    config.reads        = 0;
+    config.reloads      = 0;
+    config.root         = til_parse(code, &config.state);
+    config.snapshot     = use_snapshot ? til_snapshot_create(config.state, 0) : NULL;
+    pthread_rwlock_init(&config.lock, NULL);
+
+    pthread_t threads[64];
+    int       i;
+    for (i = 0; i < readers; i++)
+    {
+        pthread_create(&threads[i], NULL, config_reader, &config);
+    }
+
+    /* Reload every millisecond */
+    double start = now();
+    while (now() < config.deadline)
+    {
+        til_state_t* state;
+        til_value_t* root = til_parse(code, &state);
+
+        if (use_snapshot)
+        {
+            if (!til_snapshot_publish(config.snapshot, state))
+            {
+                til_release(state);
+                continue;
+            }
+        }
+        else
+        {
+            pthread_rwlock_wrlock(&config.lock);
+            til_state_t* old = config.state;
+            config.state     = state;
+            config.root      = root;
+            pthread_rwlock_unlock(&config.lock);
+            til_release(old);
+        }
+        config.reloads++;
+
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause, NULL);
+    }
+
+    for (i = 0; i < readers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    if (use_snapshot)
+    {
+        til_snapshot_destroy(config.snapshot);
+    }
+    else
+    {
+        til_release(config.state);
+    }
+    pthread_rwlock_destroy(&config.lock);
+
+    printf("  %-8s %2d readers %12.0f reads/s %6d reloads\n", use_snapshot ? "snapshot" : "rwlock", readers,
+           config.reads / elapsed, config.reloads);
+}
+
+static void bench_snapshot(void)
+{
+    char* code = make_records(100);
+
+    printf("snapshot: lookups for 0.5 s while reloading every ms\n");
+
+    int readers;
+    for (readers = 1; readers <= 64; readers *= 4)
+    {
+        measure_reads(code, 0, readers);
+        measure_reads(code, 1, readers);
+    }
+
+    free(code);
+}
+#else
+static void bench_snapshot(void)
+{
+    printf("snapshot: needs pthreads\n");
+}
+#endif
+
+/* Bytes of a file, for the parse + print baseline */
+static char* read_file(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    fseek(file, 0, SEEK_END);
+    *size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* data = (char*)malloc(*size + 1);
+    *size = fread(data, 1, *size, file);
+    data[*size] = 0;
+    fclose(file);
+    return data;
+}
+
+/* MB/s of the input, the transcoders are file to file */
+static double transcode_throughput(til_bool_t (*transcode)(FILE*, FILE*), const char* input, const char* output, size_t size)
+{
+    FILE* in  = fopen(input, "rb");
+    FILE* out = fopen(output, "wb");
+
+    double     start = now();
+    til_bool_t ok    = transcode(in, out);
+    fclose(out);
+    double elapsed = now() - start;
+
+    fclose(in);
+    if (!ok)
+    {
+        printf("  transcoding %s failed\n", input);
+    }
+    return size / elapsed / (1024 * 1024);
+}
+
+static void bench_json(void)
+{
+    int    i;
+    char*  code = make_records(100000);
+    size_t size = strlen(code);
+
+    FILE* file = fopen("til_bench.til", "wb");
+    fwrite(code, 1, size, file);
+    fclose(file);
+    free(code);
+
+    printf("json: %d bytes of code\n", (int)size);
+
+    /* Baseline: load the file, build the tree, print it */
+    double start = now();
+    code = read_file("til_bench.til", &size);
+
+    til_state_t* state;
+    til_value_t* value = til_parse(code, &state);
+
+    file = fopen("til_bench.json", "wb");
+    til_print(value, file);
+    fclose(file);
+    double print_time = now() - start;
+
+    til_stats_t stats;
+    til_stats(state, &stats);
+    printf("  til_parse + til_print  %8.2f MB/s %10d bytes of tree\n", size / print_time / (1024 * 1024), (int)stats.allocated);
+    til_release(state);
+    free(code);
+
+    printf("  til_to_json            %8.2f MB/s\n", transcode_throughput(til_to_json, "til_bench.til", "til_bench.json", size));
+
+    size_t json_size;
+    free(read_file("til_bench.json", &json_size));
+    printf("  til_from_json          %8.2f MB/s\n", transcode_throughput(til_from_json, "til_bench.json", "til_bench.til", json_size));
+
+    /* The TIL written back gives the same JSON */
+    transcode_throughput(til_to_json, "til_bench.til", "til_bench.2.json", size);
+
+    size_t round_size;
+    char*  json  = read_file("til_bench.json", &json_size);
+    char*  round = read_file("til_bench.2.json", &round_size);
+    if (json_size != round_size || memcmp(json, round, json_size) != 0)
+    {
+        printf("  round trip differs\n");
+    }
+
+    free(json);
+    free(round);
+
+    /* Numbers with an exponent must come back exact */
+    int count = 50000;
+    file = fopen("til_bench.json", "wb");
+    fprintf(file, "{");
+    for (i = 0; i < count; i++)
+    {
+        fprintf(file, "%s\"r%d\": [%.17e, %.17e, %.17E]", i > 0 ? "," : "", i,
+                (i + 1) * 1.1e-20, (i + 7) * 3.3e150, -(i + 3) / 7e5);
+    }
+    fprintf(file, "}\n");
+    json_size = (size_t)ftell(file);
+    fclose(file);
+
+    printf("  til_from_json, exp     %8.2f MB/s\n", transcode_throughput(til_from_json, "til_bench.json", "til_bench.til", json_size));
+
+    code = read_file("til_bench.til", &size);
+    value = til_parse(code, &state);
+
+    int exact = value && value->table.length == count;
+    for (i = 0; exact && i < count; i++)
+    {
+        const double* numbers = til_array_numbers(&value->table.values[i].value);
+        exact = numbers && numbers[0] == (i + 1) * 1.1e-20 && numbers[1] == (i + 7) * 3.3e150 && numbers[2] == -(i + 3) / 7e5;
+    }
+    if (!exact)
+    {
+        printf("  numbers with an exponent differ\n");
+    }
+
+    if (state)
+    {
+        til_release(state);
+    }
+    free(code);
+    remove("til_bench.til");
+    remove("til_bench.json");
+    remove("til_bench.2.json");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* name = argc > 1 ? argv[1] : NULL;
+
+    if (!name || strcmp(name, "patch") == 0)
+    {
+        bench_patch();
+    }
+
+    if (!name || strcmp(name, "hashcons") == 0)
+    {
+        bench_hashcons();
+    }
+
+    if (!name || strcmp(name, "binary") == 0)
+    {
+        bench_binary();
+    }
+
+    if (!name || strcmp(name, "iterative") == 0)
+    {
+        bench_iterative();
+    }
+
+    if (!name || strcmp(name, "stream") == 0)
+    {
+        bench_stream();
+    }
+
+    if (!name || strcmp(name, "overlay") == 0)
+    {
+        bench_overlay();
+    }
+
+    if (!name || strcmp(name, "snapshot") == 0)
+    {
+        bench_snapshot();
+    }
+
+    if (!name || strcmp(name, "json") == 0)
+    {
+        bench_json();
+    }
+
+    return 0;
+}
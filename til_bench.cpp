@@ -0,0 +1,195 @@
+/* til_bench.cpp - access cost of til.hpp against hand-written C
+ *
+ * Build & run:
+ *   c++ -std=c++17 -O2 -o til_bench_cpp til_bench.cpp -lpthread
+ *   ./til_bench_cpp
+ */
+
+#define TIL_IMPL
+#include "til.hpp"
+
+#include <string>
+#include <chrono>
+
+static double now()
+{
+    using clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(clock::now().time_since_epoch()).count();
+}
+
+static std::string make_records(int count)
+{
+    std::string code = "{\n";
+    char        entry[512];
+
+    for (int i = 0; i < count; i++)
+    {
+        snprintf(entry, sizeof(entry),
+                 "    entry%d = {\n"
+                 "        id = %d;\n"
+                 "        service = \"worker\";\n"
+                 "        limits = { cpu = 2; memory = 512; burst = [ 1, 2, 4, 8 ]; };\n"
+                 "        tags = [ \"prod\", \"eu\", true ];\n"
+                 "    };\n",
+                 i, i % 16);
+        code += entry;
+    }
+    code += "}\n";
+    return code;
+}
+
+/* Hand-written C access */
+static double sum_c(const til_value_t* root)
+{
+    double sum = 0;
+
+    for (int i = 0; i < root->table.length; i++)
+    {
+        const til_value_t* entry  = &root->table.values[i].value;
+        const til_value_t* id     = til_table_get(entry, "id");
+        const til_value_t* limits = til_table_get(entry, "limits");
+        const til_value_t* tags   = til_table_get(entry, "tags");
+
+        sum += id->number + til_table_get(limits, "memory")->number;
+
+        const til_value_t* burst = til_table_get(limits, "burst");
+        const double*      items = til_array_numbers(burst);
+        for (int j = 0; j < burst->array.length; j++)
+        {
+            sum += items[j];
+        }
+
+        for (int j = 0; j < tags->array.length; j++)
+        {
+            const til_value_t* tag = &tags->array.values[j];
+            if (tag->type == TIL_STRING && tag->string.length == 4 && memcmp(tag->string.buffer, "prod", 4) == 0)
+            {
+                sum += 1;
+            }
+        }
+    }
+
+    return sum;
+}
+
+/* Same access through the C++ handles */
+static double sum_cpp(const til::document& doc)
+{
+    double sum = 0;
+
+    for (auto entry : doc.root())
+    {
+        til::value_ref limits = entry.value["limits"];
+
+        sum += entry.value["id"].as_number() + limits["memory"].as_number();
+
+        for (til::value_ref item : limits["burst"].as_array())
+        {
+            sum += item.as_number();
+        }
+
+        for (til::value_ref tag : entry.value["tags"].as_array())
+        {
+            if (tag.as_string() == "prod")
+            {
+                sum += 1;
+            }
+        }
+    }
+
+    return sum;
+}
+
+/* The usual workaround without the wrapper: copy values, build strings to compare */
+static double sum_strings(const til_value_t* root)
+{
+    double sum = 0;
+
+    for (int i = 0; i < root->table.length; i++)
+    {
+        til_value_t entry = root->table.values[i].value;
+        til_value_t limits{};
+
+        for (int j = 0; j < entry.table.length; j++)
+        {
+            std::string name(entry.table.values[j].name.string.buffer, entry.table.values[j].name.string.length);
+            til_value_t value = entry.table.values[j].value;
+
+            if (name == "id")
+            {
+                sum += value.number;
+            }
+            else if (name == "limits")
+            {
+                limits = value;
+            }
+            else if (name == "tags")
+            {
+                for (int k = 0; k < value.array.length; k++)
+                {
+                    til_value_t tag = til_array_get(&value, k);
+                    if (tag.type == TIL_STRING && std::string(tag.string.buffer, tag.string.length) == "prod")
+                    {
+                        sum += 1;
+                    }
+                }
+            }
+        }
+
+        for (int j = 0; j < limits.table.length; j++)
+        {
+            std::string name(limits.table.values[j].name.string.buffer, limits.table.values[j].name.string.length);
+            til_value_t value = limits.table.values[j].value;
+
+            if (name == "memory")
+            {
+                sum += value.number;
+            }
+            else if (name == "burst")
+            {
+                for (int k = 0; k < value.array.length; k++)
+                {
+                    sum += til_array_get(&value, k).number;
+                }
+            }
+        }
+    }
+
+    return sum;
+}
+
+template <typename F>
+static void measure(const char* name, int iterations, F&& fn)
+{
+    double sum   = 0;
+    double start = now();
+
+    for (int i = 0; i < iterations; i++)
+    {
+        sum += fn();
+    }
+
+    double elapsed = (now() - start) / iterations;
+    printf("  %-12s %10.3f ms (checksum %.0f)\n", name, elapsed * 1000, sum);
+}
+
+int main()
+{
+    std::string   code = make_records(20000);
+    til::document doc  = til::document::parse(code.c_str());
+    if (!doc)
+    {
+        fprintf(stderr, "til_bench: failed to parse records\n");
+        return 1;
+    }
+
+    const til_value_t* root       = doc.root().get();
+    const int          iterations = 200;
+
+    printf("access: %d records, %d iterations\n", doc.root().size(), iterations);
+    measure("c", iterations, [&] { return sum_c(root); });
+    measure("til.hpp", iterations, [&] { return sum_cpp(doc); });
+    measure("std::string", iterations, [&] { return sum_strings(root); });
+
+    return 0;
+}
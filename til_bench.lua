@@ -0,0 +1,70 @@
+--
+-- Compare the pure-Lua parser (til.lua) with the C module (tilc.c)
+--
+--   cc -O2 -shared -fPIC -o tilc.so tilc.c -I/usr/include/lua5.4
+--   lua til_bench.lua [records] [iterations]
+--
+
+local til  = require("til")
+local tilc = require("tilc")
+
+local records    = tonumber(arg and arg[1]) or 2000
+local iterations = tonumber(arg and arg[2]) or 5
+
+local function makecode(count)
+    local parts = { "{\n" }
+    for i = 1, count do
+        parts[#parts + 1] = string.format(
+            "    record%d = { id = %d; name = \"item %d\"; enabled = %s; "
+            .. "weights = [ %d.5, %d.25, %d, 0.75 ]; limits = { cpu = 2; memory = 512; }; };\n",
+            i, i, i, tostring(i % 2 == 0), i, i + 1, i + 2)
+    end
+    parts[#parts + 1] = "}\n"
+    return table.concat(parts)
+end
+
+local function deepequal(a, b)
+    if type(a) ~= type(b) then
+        return false
+    elseif type(a) ~= "table" then
+        return a == b
+    end
+
+    for k, v in pairs(a) do
+        if not deepequal(v, b[k]) then
+            return false
+        end
+    end
+    for k in pairs(b) do
+        if a[k] == nil then
+            return false
+        end
+    end
+    return true
+end
+
+local function measure(name, bytes, fn)
+    local start = os.clock()
+    for _ = 1, iterations do
+        fn()
+    end
+    local elapsed = (os.clock() - start) / iterations
+    print(string.format("%-16s %10.3f ms %10.2f MB/s", name, elapsed * 1000, bytes / elapsed / (1024 * 1024)))
+    return elapsed
+end
+
+local code = makecode(records)
+print(string.format("%d records, %d bytes, %d iterations", records, #code, iterations))
+
+local value = til.parse(code)
+assert(deepequal(value, tilc.parse(code)), "til.lua and tilc disagree")
+assert(deepequal(value, tilc.parse(tilc.stringify(value))), "tilc does not round-trip")
+
+local lua_parse = measure("til.parse", #code, function() til.parse(code) end)
+local c_parse   = measure("tilc.parse", #code, function() tilc.parse(code) end)
+
+local lua_write = measure("til.stringify", #code, function() til.stringify(value) end)
+local c_write   = measure("tilc.stringify", #code, function() tilc.stringify(value) end)
+
+print(string.format("parse speedup:     %.1fx", lua_parse / c_parse))
+print(string.format("stringify speedup: %.1fx", lua_write / c_write))
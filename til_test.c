@@ -0,0 +1,737 @@
+/* til_test - regression checks of til.h
+ *
+ * Build & run:
+ *   cc -O2 -o til_test til_test.c -lpthread
+ *   ./til_test [name]
+ */
+
+#define TIL_IMPL
+#include "til.h"
+
+#include <float.h>
+#include <math.h>
+
+static int failures;
+
+static void check(int ok, const char* what)
+{
+    if (!ok)
+    {
+        printf("  failed: %s\n", what);
+        failures++;
+    }
+}
+
+/* xorshift64, the checks are the same on every run */
+static unsigned long long random_bits(void)
+{
+    static unsigned long long x = 88172645463325252ull;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+/* Text written to a temporary file by fn, NUL-terminated */
+static char* capture(void (*fn)(const til_state_t*, const til_value_t*, FILE*), const til_state_t* state, const til_value_t* value)
+{
+    FILE* file = tmpfile();
+    fn(state, value, file);
+
+    long size = ftell(file);
+    char* text = (char*)malloc(size + 1);
+    rewind(file);
+    size = (long)fread(text, 1, size, file);
+    text[size] = 0;
+
+    fclose(file);
+    return text;
+}
+
+/* Text written by til_print() or til_write(), NUL-terminated */
+static char* capture_value(void (*fn)(const til_value_t*, FILE*), const til_value_t* value)
+{
+    FILE* file = tmpfile();
+    fn(value, file);
+
+    long size = ftell(file);
+    char* text = (char*)malloc(size + 1);
+    rewind(file);
+    size = (long)fread(text, 1, size, file);
+    text[size] = 0;
+
+    fclose(file);
+    return text;
+}
+
+/* Same tree, packed and unpacked arrays compare equal */
+static int same_value(const til_value_t* a, const til_value_t* b)
+{
+    int i;
+
+    if (a->type != b->type)
+    {
+        return 0;
+    }
+
+    switch (a->type)
+    {
+    case TIL_NUMBER:
+        return a->number == b->number;
+
+    case TIL_BOOLEAN:
+        return a->boolean == b->boolean;
+
+    case TIL_STRING:
+        return a->string.length == b->string.length && memcmp(a->string.buffer, b->string.buffer, a->string.length) == 0;
+
+    case TIL_ARRAY:
+        if (a->array.length != b->array.length)
+        {
+            return 0;
+        }
+
+        for (i = 0; i < a->array.length; i++)
+        {
+            til_value_t x = til_array_get(a, i);
+            til_value_t y = til_array_get(b, i);
+            if (!same_value(&x, &y))
+            {
+                return 0;
+            }
+        }
+        return 1;
+
+    case TIL_TABLE:
+        if (a->table.length != b->table.length)
+        {
+            return 0;
+        }
+
+        for (i = 0; i < a->table.length; i++)
+        {
+            if (!same_value(&a->table.values[i].name, &b->table.values[i].name)
+                || !same_value(&a->table.values[i].value, &b->table.values[i].value))
+            {
+                return 0;
+            }
+        }
+        return 1;
+
+    default:
+        return 1;
+    }
+}
+
+/* Text written by til_write_patch() must parse back to the tree in memory */
+static int patch_round_trips(const til_state_t* state, const til_value_t* root)
+{
+    char* code = capture(til_write_patch, state, root);
+
+    til_state_t* parsed_state;
+    til_value_t* parsed = til_parse(code, &parsed_state);
+    int          same   = parsed && same_value(root, parsed);
+
+    if (parsed)
+    {
+        til_release(parsed_state);
+    }
+    free(code);
+    return same;
+}
+
+/* format_code_number() then parse_number() must give the same bits */
+static int number_round_trips(double number)
+{
+    char text[400];
+    char code[420];
+    sprintf(code, "{ a = %.*s; }", format_code_number(text, number), text);
+
+    til_state_t* state;
+    til_value_t* root = til_parse(code, &state);
+    if (!root)
+    {
+        return 0;
+    }
+
+    double parsed = til_table_get(root, "a")->number;
+    til_release(state);
+    return memcmp(&parsed, &number, sizeof(double)) == 0;
+}
+
+static void test_numbers(void)
+{
+    static const double edges[] = {
+        0.0, -0.0, 1.0, -1.0, 0.1, 0.30000000000000004, 1e-20, 1e-7, 5e-324, DBL_MIN, DBL_MAX, -DBL_MAX,
+        1e15, 1e22, 1e23, 123456789012345678.0, 2.5, 0.001,
+    };
+
+    printf("numbers\n");
+
+    int i, bad = 0;
+    for (i = 0; i < (int)(sizeof(edges) / sizeof(edges[0])); i++)
+    {
+        bad += !number_round_trips(edges[i]);
+    }
+
+    for (i = 0; i < 200000; i++)
+    {
+        unsigned long long bits = random_bits();
+        double             number;
+        memcpy(&number, &bits, sizeof(double));
+
+        if (number - number == 0)
+        {
+            bad += !number_round_trips(number);
+        }
+        bad += !number_round_trips((double)(bits % 1000000) / 1000.0);
+    }
+    check(bad == 0, "numbers read back with the same bits");
+
+    /* Edits are written with exact digits */
+    til_state_t* state;
+    til_value_t* root = til_parse("{ a = 1; }", &state);
+
+    til_value_t small;
+    memset(&small, 0, sizeof(small));
+    small.type   = TIL_NUMBER;
+    small.number = 1e-20;
+    til_table_set(state, root, "small", &small);
+
+    char* code = capture(til_write_patch, state, root);
+    check(strstr(code, "small = 0.00000000000000000001;") != NULL, "til_write_patch writes 1e-20 exactly");
+
+    free(code);
+    til_release(state);
+}
+
+/* A random container of the tree, or the root */
+static til_value_t* random_container(til_value_t* value)
+{
+    for (;;)
+    {
+        til_value_t* child = NULL;
+        if (random_bits() % 3 == 0)
+        {
+            return value;
+        }
+        else if (value->type == TIL_TABLE && value->table.length > 0)
+        {
+            child = &value->table.values[random_bits() % value->table.length].value;
+        }
+        else if (value->type == TIL_ARRAY && value->array.kind == TIL_ARRAY_VALUES && value->array.length > 0)
+        {
+            child = &value->array.values[random_bits() % value->array.length];
+        }
+
+        if (!child || (child->type != TIL_TABLE && child->type != TIL_ARRAY))
+        {
+            return value;
+        }
+        value = child;
+    }
+}
+
+/* Edits of identical subtrees must not show up in the others */
+static void test_hashcons(void)
+{
+    const char* code =
+        "{ x = { e = {}; a = []; n = [1, 2]; t = { q = \"s\"; }; };"
+        "  y = { e = {}; a = []; n = [1, 2]; t = { q = \"s\"; }; };"
+        "  z = [ {}, {}, [ \"s\", {} ] ]; }";
+
+    printf("hashcons\n");
+
+    til_options_t options = { TIL_PARSE_HASHCONS, 0 };
+    int           bad     = 0;
+    int           edits   = 0;
+
+    int run, i;
+    for (run = 0; run < 400; run++)
+    {
+        til_state_t* state;
+        til_value_t* root = til_parse_ex(code, &options, &state);
+
+        for (i = 0; i < 3; i++)
+        {
+            til_value_t* container = random_container(root);
+
+            til_value_t number;
+            memset(&number, 0, sizeof(number));
+            number.type   = TIL_NUMBER;
+            number.number = (double)(random_bits() % 9);
+
+            if (container->type == TIL_TABLE)
+            {
+                edits += til_table_set(state, container, random_bits() % 2 ? "k" : "e", &number) != NULL;
+            }
+            else
+            {
+                edits += til_array_insert(state, container, 0, &number) != NULL;
+            }
+        }
+
+        bad += !patch_round_trips(state, root);
+        til_release(state);
+    }
+
+    check(edits > 0, "edits of the root are accepted");
+    check(bad == 0, "random edits are written back by til_write_patch");
+}
+
+/* { a = [[[...]]]; } with depth nested arrays */
+static char* make_nested(int depth)
+{
+    char* code = (char*)malloc(2 * depth + 16);
+    int   length = sprintf(code, "{ a = ");
+
+    memset(code + length, '[', depth);
+    memset(code + length + depth, ']', depth);
+    strcpy(code + length + 2 * depth, "; }");
+    return code;
+}
+
+#if !defined(_WIN32)
+#include <pthread.h>
+
+static void* parse_nested(void* arg)
+{
+    til_state_t* state;
+    til_value_t* root = til_parse((const char*)arg, &state);
+    if (root)
+    {
+        til_release(state);
+    }
+    return root ? arg : NULL;
+}
+
+/* til_parse() must not recurse: deep documents parse on a 64 KB stack */
+static void test_small_stack(void)
+{
+    static const int depths[] = { 300, 998, 5000 };
+
+    printf("small_stack\n");
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, 64 * 1024);
+
+    int i;
+    for (i = 0; i < 3; i++)
+    {
+        char*     code   = make_nested(depths[i]);
+        void*     result = NULL;
+        pthread_t thread;
+
+        if (pthread_create(&thread, &attributes, parse_nested, code) == 0)
+        {
+            pthread_join(thread, &result);
+        }
+
+        /* Deeper than TIL_MAX_DEPTH fails cleanly */
+        check((result != NULL) == (depths[i] < TIL_MAX_DEPTH), depths[i] < TIL_MAX_DEPTH
+              ? "nested documents parse on a 64 KB stack" : "documents deeper than TIL_MAX_DEPTH fail");
+        free(code);
+    }
+
+    pthread_attr_destroy(&attributes);
+}
+#else
+static void test_small_stack(void)
+{
+    printf("small_stack: needs pthreads\n");
+}
+#endif
+
+/* An overlay is written from scratch and parses back to the merged tree */
+static void test_overlay_patch(void)
+{
+    printf("overlay_patch\n");
+
+    til_state_t* base;
+    til_state_t* patch;
+    til_state_t* merged;
+    til_parse("{ svc = { limits = { cpu = 2; }; name = \"a\"; }; hosts = [1, 2]; }\n", &base);
+    til_parse("{ svc = { name = \"b\"; }; extra = true; }", &patch);
+
+    til_value_t* root = til_overlay(base, patch, TIL_MERGE_DEFAULT, &merged);
+    check(root && patch_round_trips(merged, root), "til_write_patch of an overlay parses back");
+
+    /* Nothing is copied from the empty source buffer of the overlay */
+    FILE* file = tmpfile();
+    til_write_patch(merged, root, file);
+
+    long size = ftell(file);
+    char last = 0;
+    fseek(file, -1, SEEK_END);
+    check(size > 0 && fread(&last, 1, 1, file) == 1 && last == '}', "til_write_patch of an overlay ends at its root");
+    fclose(file);
+
+    til_release(merged);
+    til_release(patch);
+    til_release(base);
+}
+
+/* The inputs of an overlay are read-only while the result shares them */
+static void test_overlay_layers(void)
+{
+    printf("overlay_layers\n");
+
+    til_state_t* base;
+    til_state_t* patch;
+    til_state_t* merged;
+    til_value_t* base_root = til_parse("{ svc = { limits = { cpu = 2; }; }; hosts = [1, 2]; }", &base);
+    til_parse("{ svc = { name = \"b\"; }; }", &patch);
+    til_value_t* root = til_overlay(base, patch, TIL_MERGE_DEFAULT, &merged);
+
+    til_value_t number;
+    memset(&number, 0, sizeof(number));
+    number.type   = TIL_NUMBER;
+    number.number = 4;
+
+    til_value_t* svc    = til_table_get(root, "svc");
+    til_value_t* limits = til_table_get(svc, "limits");
+    check(til_table_set(merged, svc, "cpu", &number) != NULL, "tables copied by the overlay can be edited");
+    check(til_table_set(merged, limits, "cpu", &number) == NULL, "tables shared by the overlay are refused");
+    check(til_table_set(base, til_table_get(base_root, "svc"), "cpu", &number) == NULL, "the base is refused while overlaid");
+    check(til_array_insert(base, til_table_get(base_root, "hosts"), 0, &number) == NULL, "arrays of the base are refused while overlaid");
+    check(til_table_get(limits, "cpu")->number == 2, "the overlay still sees the base");
+
+    til_release(merged);
+    check(til_table_set(base, til_table_get(base_root, "svc"), "cpu", &number) != NULL, "the base can be edited once the overlay is released");
+
+    til_release(patch);
+    til_release(base);
+}
+
+/* Output of a streaming transcoder for the given input, NULL when it fails */
+static char* transcode_text(til_bool_t (*fn)(FILE*, FILE*), const char* text)
+{
+    FILE* in  = tmpfile();
+    FILE* out = tmpfile();
+    fputs(text, in);
+    rewind(in);
+
+    char* result = NULL;
+    if (fn(in, out))
+    {
+        long size = ftell(out);
+        result = (char*)malloc(size + 1);
+        rewind(out);
+        size = (long)fread(result, 1, size, out);
+        result[size] = 0;
+    }
+
+    fclose(in);
+    fclose(out);
+    return result;
+}
+
+/* Whether fn accepts text and its output contains expected */
+static int transcodes_to(til_bool_t (*fn)(FILE*, FILE*), const char* text, const char* expected)
+{
+    char* result = transcode_text(fn, text);
+    int   found  = result && strstr(result, expected) != NULL;
+    free(result);
+    return found;
+}
+
+static int transcode_fails(til_bool_t (*fn)(FILE*, FILE*), const char* text)
+{
+    char* result = transcode_text(fn, text);
+    free(result);
+    return result == NULL;
+}
+
+/* Numbers of any length go through the transcoders */
+static void test_transcode_numbers(void)
+{
+    printf("transcode_numbers\n");
+
+    char digits[700];
+    char text[800];
+    memset(digits, '7', 600);
+    strcpy(digits + 600, ".25");
+
+    sprintf(text, "{\"a\": %s}", digits);
+    check(transcodes_to(til_from_json, text, digits), "til_from_json copies a 600 digit number");
+    sprintf(text, "{ a = %s; }", digits);
+    check(transcodes_to(til_to_json, text, digits), "til_to_json copies a 600 digit number");
+
+    sprintf(text, "{\"a\": %se5}", digits);
+    check(transcode_fails(til_from_json, text), "til_from_json refuses a 600 digit number with an exponent");
+
+    check(transcodes_to(til_from_json, "{\"a\": [1e-20]}", "0.00000000000000000001"), "til_from_json writes 1e-20 exactly");
+    check(transcodes_to(til_from_json, "{\"a\": [0.5e1, -0]}", "[5,-0]"), "til_from_json applies exponents");
+    check(transcode_fails(til_from_json, "{\"a\": [1e400]}"), "til_from_json refuses overflows");
+    check(transcode_fails(til_from_json, "{\"a\": [1e-400]}"), "til_from_json refuses underflows");
+    check(transcode_fails(til_from_json, "{\"a\": [007]}"), "til_from_json refuses leading zeros");
+    check(transcode_fails(til_from_json, "{\"a\": [1.5.2]}"), "til_from_json refuses a second '.'");
+
+    check(transcodes_to(til_to_json, "{ a = -007.5; }", "-7.5"), "til_to_json drops leading zeros");
+    check(transcodes_to(til_to_json, "{ a = -.5; }", "-0.5"), "til_to_json writes a digit before '.'");
+    check(transcodes_to(til_to_json, "{ a = 0; b = -0; }", "-0"), "til_to_json keeps zeros");
+    check(transcode_fails(til_to_json, "{ a = 007; }"), "til_to_json refuses unsigned leading zeros");
+    check(transcode_fails(til_to_json, "{ a = 1.; }"), "til_to_json refuses a '.' without digits");
+    check(transcode_fails(til_to_json, "{ a = 1.2.3; }"), "til_to_json refuses a second '.'");
+    check(transcode_fails(til_to_json, "{ a = -; }"), "til_to_json refuses a sign alone");
+}
+
+/* til_print() writes valid JSON numbers, til_write() code that parses back */
+static void test_print_write(void)
+{
+    printf("print_write\n");
+
+    til_state_t* state;
+    til_value_t* root = til_parse(
+        "{ a = [1, 0.0000001, 123456789.125]; [\"b c\"] = nil; d = { e = \"s\"; f = [true, {}, []]; }; g = 0.1; }",
+        &state);
+
+    til_value_t number;
+    memset(&number, 0, sizeof(number));
+    number.type   = TIL_NUMBER;
+    number.number = HUGE_VAL;
+    til_array_insert(state, til_table_get(root, "a"), 0, &number);
+
+    char* json = capture_value(til_print, root);
+    check(strstr(json, "inf") == NULL && strstr(json, "null,\n        1,") != NULL, "til_print writes inf in a packed array as null");
+    check(strstr(json, "0.0000001,") != NULL && strstr(json, "123456789.125") != NULL, "til_print writes packed numbers exactly");
+    check(strstr(json, "0.1\n") != NULL, "til_print writes numbers exactly");
+    free(json);
+
+    til_array_remove(state, til_table_get(root, "a"), 0);
+
+    char* code = capture_value(til_write, root);
+    til_state_t* parsed_state;
+    til_value_t* parsed = til_parse(code, &parsed_state);
+    check(parsed && same_value(root, parsed), "til_write writes code that parses back");
+    if (parsed)
+    {
+        til_release(parsed_state);
+    }
+    free(code);
+
+    til_release(state);
+}
+
+/* Edits deep in a document, the text around them is copied as it is */
+static void test_patch_edits(void)
+{
+    printf("patch_edits\n");
+
+    til_state_t* state;
+    til_value_t* root = til_parse(
+        "{\n"
+        "    a = { b = { c = 1; };  -- kept\n"
+        "          d = [ 1,  2 ]; };\n"
+        "    e = [ { f = \"x\"; }, [ 3 ] ];\n"
+        "}\n", &state);
+
+    til_value_t number;
+    memset(&number, 0, sizeof(number));
+    number.type   = TIL_NUMBER;
+    number.number = 5;
+
+    til_value_t* b = til_table_get(til_table_get(root, "a"), "b");
+    til_table_set(state, b, "c", &number);
+    til_array_insert(state, &til_table_get(root, "e")->array.values[1], 1, &number);
+    til_table_remove(state, &til_table_get(root, "e")->array.values[0], "f");
+
+    char* code = capture(til_write_patch, state, root);
+    check(strcmp(code,
+                 "{\n"
+                 "    a = { b = { c = 5; };  -- kept\n"
+                 "          d = [ 1,  2 ]; };\n"
+                 "    e = [ { }, [3, 5] ];\n"
+                 "}\n") == 0, "til_write_patch keeps the text around nested edits");
+
+    free(code);
+    til_release(state);
+}
+
+static void write_file(const char* path, const char* data, long size)
+{
+    FILE* file = fopen(path, "wb");
+    fwrite(data, 1, size, file);
+    fclose(file);
+}
+
+/* Reads every node of an image through the accessors, returns the strings
+ * without a NUL where their node says they end.
+ */
+static int walk_image(const til_image_t* image, const til_node_t* node, int depth)
+{
+    int bad = 0;
+    unsigned i;
+
+    if (!node || depth > 32)
+    {
+        return 0;
+    }
+
+    if (node->type == TIL_STRING)
+    {
+        const char* string = til_node_string(image, node);
+        bad += string && string[node->length] != 0;
+    }
+    else if (node->type == TIL_ARRAY && node->kind == TIL_ARRAY_NUMBERS)
+    {
+        const double* numbers = til_node_numbers(image, node);
+        volatile double sum = 0;
+        for (i = 0; numbers && i < node->length && i < 64; i++)
+        {
+            sum += numbers[i];
+        }
+    }
+    else if (node->type == TIL_ARRAY)
+    {
+        for (i = 0; i < node->length && i < 64; i++)
+        {
+            bad += walk_image(image, til_node_at(image, node, (int)i), depth + 1);
+        }
+    }
+    else if (node->type == TIL_TABLE)
+    {
+        for (i = 0; i < node->length && i < 64; i++)
+        {
+            bad += walk_image(image, til_node_name(image, node, (int)i), depth + 1);
+            bad += walk_image(image, til_node_value(image, node, (int)i), depth + 1);
+        }
+    }
+    return bad;
+}
+
+/* Corrupt images are refused node by node, never read out of place */
+static void test_binary_image(void)
+{
+    const char* path = "til_test.bin";
+
+    printf("binary_image\n");
+
+    til_state_t* state;
+    til_value_t* root = til_parse("{ a = [ { b = \"text\"; }, 1, true ]; n = [1.5, 2]; s = \"str\"; }", &state);
+    check(til_save_binary(root, path), "til_save_binary writes the image");
+    til_release(state);
+
+    FILE* file = fopen(path, "rb");
+    fseek(file, 0, SEEK_END);
+    long  size  = ftell(file);
+    char* bytes = (char*)malloc(size);
+    char* fuzz  = (char*)malloc(size);
+    rewind(file);
+    size = (long)fread(bytes, 1, size, file);
+    fclose(file);
+
+    /* Where the a, n and s nodes are in the file */
+    til_image_t*      image = til_load_binary(path);
+    const til_node_t* top   = til_image_root(image);
+    const til_node_t* a     = til_node_get(image, top, "a");
+    const til_node_t* n     = til_node_get(image, top, "n");
+    const til_node_t* s     = til_node_get(image, top, "s");
+    check(a && n && s && strcmp(til_node_string(image, s), "str") == 0 && til_node_numbers(image, n)[0] == 1.5,
+          "til_load_binary reads the image back");
+
+    long a_at = (long)((const char*)a - image->data);
+    long n_at = (long)((const char*)n - image->data);
+    long s_at = (long)((const char*)s - image->data);
+    til_unload_binary(image);
+
+    til_node_t node;
+    memcpy(fuzz, bytes, size);
+    memcpy(&node, fuzz + a_at, sizeof(node));
+    node.offset += 4;
+    memcpy(fuzz + a_at, &node, sizeof(node));
+    memcpy(&node, fuzz + n_at, sizeof(node));
+    node.offset += 4;
+    memcpy(fuzz + n_at, &node, sizeof(node));
+    memcpy(&node, fuzz + s_at, sizeof(node));
+    node.length -= 1;
+    memcpy(fuzz + s_at, &node, sizeof(node));
+    write_file(path, fuzz, size);
+
+    image = til_load_binary(path);
+    top   = til_image_root(image);
+    check(til_node_at(image, til_node_get(image, top, "a"), 0) == NULL, "misaligned nodes are refused");
+    check(til_node_numbers(image, til_node_get(image, top, "n")) == NULL, "misaligned numbers are refused");
+    check(til_node_string(image, til_node_get(image, top, "s")) == NULL, "strings without a NUL at their end are refused");
+    til_unload_binary(image);
+
+    /* The header is checksummed, the nodes after it are not */
+    int bad = 0;
+    int run, i;
+    for (run = 0; run < 2000; run++)
+    {
+        memcpy(fuzz, bytes, size);
+        for (i = 0; i < 4; i++)
+        {
+            long at = (long)sizeof(til_image_header_t) + (long)(random_bits() % (size - sizeof(til_image_header_t)));
+            fuzz[at] = (char)random_bits();
+        }
+        write_file(path, fuzz, size);
+
+        image = til_load_binary(path);
+        if (image)
+        {
+            bad += walk_image(image, til_image_root(image), 0);
+            til_unload_binary(image);
+        }
+    }
+    check(bad == 0, "fuzzed images only return terminated strings");
+
+    remove(path);
+    free(fuzz);
+    free(bytes);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* name = argc > 1 ? argv[1] : NULL;
+
+    if (!name || strcmp(name, "numbers") == 0)
+    {
+        test_numbers();
+    }
+
+    if (!name || strcmp(name, "patch_edits") == 0)
+    {
+        test_patch_edits();
+    }
+
+    if (!name || strcmp(name, "hashcons") == 0)
+    {
+        test_hashcons();
+    }
+
+    if (!name || strcmp(name, "binary_image") == 0)
+    {
+        test_binary_image();
+    }
+
+    if (!name || strcmp(name, "small_stack") == 0)
+    {
+        test_small_stack();
+    }
+
+    if (!name || strcmp(name, "overlay_patch") == 0)
+    {
+        test_overlay_patch();
+    }
+
+    if (!name || strcmp(name, "overlay_layers") == 0)
+    {
+        test_overlay_layers();
+    }
+
+    if (!name || strcmp(name, "transcode_numbers") == 0)
+    {
+        test_transcode_numbers();
+    }
+
+    if (!name || strcmp(name, "print_write") == 0)
+    {
+        test_print_write();
+    }
+
+    printf(failures ? "%d failed\n" : "all passed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,401 @@
+/* tilc - Lua binding of til.h, same API as til.lua
+ *
+ *   local til = require("tilc")
+ *   local value = til.parse(code)
+ *   local code  = til.stringify(value)
+ *
+ * Build:
+ *   cc -O2 -shared -fPIC -o tilc.so tilc.c -I/usr/include/lua5.4
+ */
+
+#define TIL_IMPL
+#define TIL_NO_THREADS
+#include "til.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <limits.h>
+
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen(L, idx)  lua_objlen(L, idx)
+#define luaL_newlib(L, l)   (lua_newtable(L), luaL_register(L, NULL, l))
+#endif
+
+/*
+ * Parsing: til_value_t tree to Lua tables
+ */
+
+static void push_value(lua_State* L, const til_value_t* value)
+{
+    int i, n;
+
+    luaL_checkstack(L, 3, "til: document is nested too deep");
+    switch (value->type)
+    {
+    case TIL_NUMBER:
+        lua_pushnumber(L, value->number);
+        break;
+
+    case TIL_BOOLEAN:
+        lua_pushboolean(L, value->boolean);
+        break;
+
+    case TIL_STRING:
+        lua_pushlstring(L, value->string.buffer, value->string.length);
+        break;
+
+    case TIL_ARRAY:
+        n = value->array.length;
+        lua_createtable(L, n, 0);
+
+        if (value->array.kind == TIL_ARRAY_NUMBERS)
+        {
+            for (i = 0; i < n; i++)
+            {
+                lua_pushnumber(L, value->array.numbers[i]);
+                lua_rawseti(L, -2, i + 1);
+            }
+        }
+        else
+        {
+            for (i = 0; i < n; i++)
+            {
+                if (value->array.values[i].type != TIL_NIL)
+                {
+                    push_value(L, &value->array.values[i]);
+                    lua_rawseti(L, -2, i + 1);
+                }
+            }
+        }
+        break;
+
+    case TIL_TABLE:
+        n = value->table.length;
+        lua_createtable(L, 0, n);
+
+        for (i = 0; i < n; i++)
+        {
+            const til_cell_t* cell = &value->table.values[i];
+            if (cell->value.type != TIL_NIL)
+            {
+                lua_pushlstring(L, cell->name.string.buffer, cell->name.string.length);
+                push_value(L, &cell->value);
+                lua_rawset(L, -3);
+            }
+        }
+        break;
+
+    default:
+        lua_pushnil(L);
+        break;
+    }
+}
+
+/* Keeps the state of tilc_parse released when push_value raises */
+static int state_gc(lua_State* L)
+{
+    til_state_t** state = (til_state_t**)lua_touserdata(L, 1);
+    if (*state)
+    {
+        til_release(*state);
+        *state = NULL;
+    }
+    return 0;
+}
+
+/* @funcdef: parse */
+static int tilc_parse(lua_State* L)
+{
+    size_t      length;
+    const char* code = luaL_checklstring(L, 1, &length);
+
+    lua_settop(L, 1);
+
+    til_state_t** state = (til_state_t**)lua_newuserdata(L, sizeof(til_state_t*));
+    *state = NULL;
+
+    if (luaL_newmetatable(L, "tilc_state_t"))
+    {
+        lua_pushcfunction(L, state_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    til_value_t* value = til_parse(code, state);
+    if (!value)
+    {
+        /* Like til.lua: nil when the code is not a table, an error when it does not parse */
+        int start = scan_trivia(code, 0, (int)length);
+        if (start < (int)length && code[start] == '{')
+        {
+            return luaL_error(L, "til: syntax error");
+        }
+
+        lua_pushnil(L);
+        return 1;
+    }
+
+    push_value(L, value);
+    til_release(*state);
+    *state = NULL;
+    return 1;
+}
+
+/*
+ * Stringify: Lua tables to TIL code
+ *
+ * The traversal keeps keys and values on the Lua stack, which a luaL_Buffer
+ * does not allow, so the output goes to a growable buffer owned by a
+ * userdata (freed by __gc when an error is raised halfway).
+ */
+
+typedef struct tilc_buffer_t
+{
+    size_t length;
+    size_t capacity;
+    char*  data;
+} tilc_buffer_t;
+
+static int buffer_gc(lua_State* L)
+{
+    tilc_buffer_t* buffer = (tilc_buffer_t*)lua_touserdata(L, 1);
+    free(buffer->data);
+    buffer->data = NULL;
+    return 0;
+}
+
+static void buffer_add(lua_State* L, tilc_buffer_t* buffer, const char* data, size_t length)
+{
+    if (buffer->length + length > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : 256;
+        while (capacity < buffer->length + length)
+        {
+            capacity *= 2;
+        }
+
+        char* new_data = (char*)realloc(buffer->data, capacity);
+        if (!new_data)
+        {
+            luaL_error(L, "til: out of memory");
+        }
+
+        buffer->data     = new_data;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+#define buffer_addliteral(L, buffer, s) buffer_add(L, buffer, "" s, sizeof(s) - 1)
+
+/* Number of elements when the table at idx is a non-empty sequence, 0 otherwise */
+static size_t sequence_length(lua_State* L, int idx)
+{
+    size_t length = lua_rawlen(L, idx);
+    size_t count  = 0;
+
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, idx))
+    {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) != LUA_TNUMBER || ++count > length)
+        {
+            lua_pop(L, 1);
+            return 0;
+        }
+    }
+    return count == length ? length : 0;
+}
+
+static void add_string(lua_State* L, tilc_buffer_t* buffer, int idx)
+{
+    size_t      length;
+    const char* string = lua_tolstring(L, idx, &length);
+
+    if (memchr(string, '"', length))
+    {
+        luaL_error(L, "til: string cannot contain '\"'");
+    }
+
+    buffer_addliteral(L, buffer, "\"");
+    buffer_add(L, buffer, string, length);
+    buffer_addliteral(L, buffer, "\"");
+}
+
+static void add_number(lua_State* L, tilc_buffer_t* buffer, lua_Number number)
+{
+    char text[400];
+
+    if (number != number || number - number != 0)
+    {
+        luaL_error(L, "til: cannot stringify inf or nan");
+    }
+
+    /* Exact digits, TIL numbers have no exponent part */
+    buffer_add(L, buffer, text, format_code_number(text, (double)number));
+}
+
+static void add_value(lua_State* L, tilc_buffer_t* buffer, int idx, int depth);
+
+static void add_table(lua_State* L, tilc_buffer_t* buffer, int idx, int depth)
+{
+    size_t length = sequence_length(L, idx);
+    size_t i;
+
+    if (length > 0)
+    {
+        buffer_addliteral(L, buffer, "[");
+        for (i = 1; i <= length; i++)
+        {
+            if (i > 1)
+            {
+                buffer_addliteral(L, buffer, ",");
+            }
+
+            lua_rawgeti(L, idx, (int)i);
+            add_value(L, buffer, lua_gettop(L), depth + 1);
+            lua_pop(L, 1);
+        }
+        buffer_addliteral(L, buffer, "]");
+    }
+    else
+    {
+        buffer_addliteral(L, buffer, "{");
+
+        lua_pushnil(L);
+        while (lua_next(L, idx))
+        {
+            int key = lua_gettop(L) - 1;
+            if (lua_type(L, key) == LUA_TSTRING)
+            {
+                size_t      name_length;
+                const char* name = lua_tolstring(L, key, &name_length);
+                if (name_length <= INT_MAX && is_symbol(name, (int)name_length))
+                {
+                    buffer_add(L, buffer, name, name_length);
+                }
+                else
+                {
+                    buffer_addliteral(L, buffer, "[");
+                    add_string(L, buffer, key);
+                    buffer_addliteral(L, buffer, "]");
+                }
+            }
+            else if (lua_type(L, key) != LUA_TNUMBER)
+            {
+                luaL_error(L, "til: cannot stringify a %s key", luaL_typename(L, key));
+            }
+            else
+            {
+                /* Copy the key, lua_tolstring would change its type and break lua_next */
+                lua_pushvalue(L, key);
+                buffer_addliteral(L, buffer, "[");
+                add_string(L, buffer, lua_gettop(L));
+                buffer_addliteral(L, buffer, "]");
+                lua_pop(L, 1);
+            }
+
+            buffer_addliteral(L, buffer, "=");
+            add_value(L, buffer, lua_gettop(L), depth + 1);
+            buffer_addliteral(L, buffer, ";");
+
+            lua_pop(L, 1);
+        }
+
+        buffer_addliteral(L, buffer, "}");
+    }
+}
+
+static void add_value(lua_State* L, tilc_buffer_t* buffer, int idx, int depth)
+{
+    if (depth > 1000)
+    {
+        luaL_error(L, "til: table is nested too deep (cycle?)");
+    }
+
+    luaL_checkstack(L, 4, "til: table is nested too deep");
+    switch (lua_type(L, idx))
+    {
+    case LUA_TNIL:
+        buffer_addliteral(L, buffer, "nil");
+        break;
+
+    case LUA_TBOOLEAN:
+        if (lua_toboolean(L, idx))
+        {
+            buffer_addliteral(L, buffer, "true");
+        }
+        else
+        {
+            buffer_addliteral(L, buffer, "false");
+        }
+        break;
+
+    case LUA_TNUMBER:
+        add_number(L, buffer, lua_tonumber(L, idx));
+        break;
+
+    case LUA_TSTRING:
+        add_string(L, buffer, idx);
+        break;
+
+    case LUA_TTABLE:
+        add_table(L, buffer, idx, depth);
+        break;
+
+    default:
+        luaL_error(L, "til: cannot stringify a %s", luaL_typename(L, idx));
+        break;
+    }
+}
+
+/* @funcdef: stringify */
+static int tilc_stringify(lua_State* L)
+{
+    if (lua_type(L, 1) != LUA_TTABLE || sequence_length(L, 1) > 0)
+    {
+        return luaL_error(L, "Require table to stringify");
+    }
+
+    lua_settop(L, 1);
+
+    tilc_buffer_t* buffer = (tilc_buffer_t*)lua_newuserdata(L, sizeof(tilc_buffer_t));
+    buffer->length   = 0;
+    buffer->capacity = 0;
+    buffer->data     = NULL;
+
+    if (luaL_newmetatable(L, "tilc_buffer_t"))
+    {
+        lua_pushcfunction(L, buffer_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    add_table(L, buffer, 1, 0);
+
+    lua_pushlstring(L, buffer->data, buffer->length);
+    free(buffer->data);
+    buffer->data = NULL;
+    return 1;
+}
+
+static const luaL_Reg tilc_functions[] = {
+    { "parse",     tilc_parse     },
+    { "stringify", tilc_stringify },
+    { NULL,        NULL           },
+};
+
+/* @funcdef: luaopen_tilc */
+LUALIB_API int luaopen_tilc(lua_State* L)
+{
+    luaL_newlib(L, tilc_functions);
+    return 1;
+}